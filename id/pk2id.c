@@ -28,9 +28,11 @@
 static const struct option LONG_OPTIONS[] = {
 	{"device", required_argument, 0, 'd'},
 	{"help", no_argument, 0, 'h'},
+	{"stats", no_argument, 0, 's'},
 	{0, 0, 0, 0}
 };
-static const char SHORT_OPTIONS[] = "d:h";
+static const char SHORT_OPTIONS[] = "d:hs";
+static int dump_stats = 0;
 
 
 
@@ -40,7 +42,7 @@ static int set_id(const char *appname, const char *path, const char *id) {
 	pk2aux_handle handle = 0;
 
 	/* Initialize the library. */
-	if ((rc = pk2aux_init()) < 0) {
+	if ((rc = pk2aux_init_ex(PK2AUX_INIT_LAZY)) < 0) {
 		goto errout;
 	}
 
@@ -65,6 +67,9 @@ static int set_id(const char *appname, const char *path, const char *id) {
 
 out:
 	if (handle) {
+		if (dump_stats) {
+			pk2aux_dump_stats(handle, stderr);
+		}
 		pk2aux_close(handle);
 		handle = 0;
 	}
@@ -84,6 +89,7 @@ static void usage(const char *appname) {
 			"Options:\n"
 			" -d path, --device path      the path to the PICkit2, as printed by pk2ls\n"
 			" -h, --help                  display this usage message\n"
+			" -s, --stats                 print traffic statistics to stderr on exit\n"
 			"\n"
 			"Assigns a unit ID to a PICkit2. If no new_unit_id is provided, deletes the unit\n"
 			"ID.\n",
@@ -106,6 +112,10 @@ int main(int argc, char **argv) {
 				usage(argv[0]);
 				return EXIT_SUCCESS;
 
+			case 's':
+				dump_stats = 1;
+				break;
+
 			default:
 				return EXIT_FAILURE;
 		}
@@ -0,0 +1,290 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "internal.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+
+
+/* One device's line in the cache file. Present is set once the device has been seen by this
+ * process; entries that are never seen are dropped when a scan is done. */
+struct cache_entry {
+	char key[PK2AUX_CACHE_KEY_SIZE];
+	unsigned char version[3];
+	unsigned char eeprom[16];
+	int present;
+};
+
+/* The cache is shared by every context that enables it, and loaded while any of them exists. */
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int users = 0;
+static struct cache_entry *entries = 0;
+static unsigned int num_entries = 0;
+static int dirty = 0;
+
+
+
+static const char *cache_path(char *buffer, size_t size) {
+	const char *env;
+
+	if ((env = getenv("PK2AUX_CACHE")) && *env) {
+		return env;
+	}
+
+	if ((env = getenv("HOME")) && *env) {
+		if ((size_t) snprintf(buffer, size, "%s/.pk2aux_cache", env) < size) {
+			return buffer;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static struct cache_entry *find_entry(const char *key) {
+	unsigned int i;
+
+	for (i = 0; i < num_entries; ++i) {
+		if (strcmp(entries[i].key, key) == 0) {
+			return &entries[i];
+		}
+	}
+
+	return 0;
+}
+
+
+
+int pk2aux_cache_key(libusb_device *device, char *key) {
+	struct libusb_device_descriptor ddev;
+	uint8_t ports[7];
+	int num_ports, i, used;
+
+	/* The device address is part of the key as well as the port it's plugged into, so that a
+	 * device that gets swapped out (and therefore re-enumerated) never matches an old entry. */
+	if (libusb_get_device_descriptor(device, &ddev) < 0) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+	if ((num_ports = libusb_get_port_numbers(device, ports, sizeof(ports))) < 0) {
+		return num_ports;
+	}
+
+	used = snprintf(key, PK2AUX_CACHE_KEY_SIZE, "%u-", libusb_get_bus_number(device));
+	for (i = 0; i < num_ports; ++i) {
+		used += snprintf(key + used, PK2AUX_CACHE_KEY_SIZE - used, i ? ".%u" : "%u", ports[i]);
+	}
+	snprintf(key + used, PK2AUX_CACHE_KEY_SIZE - used, "@%u/%04x", libusb_get_device_address(device), ddev.bcdDevice);
+	return 0;
+}
+
+
+
+static void read_cache(void) {
+	char path_buffer[256], line[128];
+	const char *path;
+	struct cache_entry entry, *tmp;
+	unsigned int i, byte, major, minor, micro;
+	int used;
+	char *field, *hex;
+	FILE *fp;
+
+	if (!(path = cache_path(path_buffer, sizeof(path_buffer)))) {
+		return;
+	}
+	if (!(fp = fopen(path, "r"))) {
+		return;
+	}
+
+	/* Each line is a key, the firmware version, and the 16 EEPROM bytes holding the unit ID in
+	 * hex, separated by spaces. Anything that doesn't look like that (such as a line written
+	 * before the version was recorded) is skipped; it'll just be probed again. */
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || !(field = strchr(line, ' ')) || (size_t) (field - line) >= sizeof(entry.key)) {
+			continue;
+		}
+		memcpy(entry.key, line, field - line);
+		entry.key[field - line] = '\0';
+		if (sscanf(field + 1, "%u.%u.%u%n", &major, &minor, &micro, &used) != 3 || major > 255 || minor > 255 || micro > 255 || field[1 + used] != ' ') {
+			continue;
+		}
+		entry.version[0] = (unsigned char) major;
+		entry.version[1] = (unsigned char) minor;
+		entry.version[2] = (unsigned char) micro;
+		entry.present = 0;
+		for (i = 0, hex = field + 2 + used; i < 16; ++i, hex += 2) {
+			if (sscanf(hex, "%2x", &byte) != 1) {
+				break;
+			}
+			entry.eeprom[i] = (unsigned char) byte;
+		}
+		if (i != 16) {
+			continue;
+		}
+
+		if (!(tmp = realloc(entries, (num_entries + 1) * sizeof(*entries)))) {
+			break;
+		}
+		entries = tmp;
+		entries[num_entries++] = entry;
+	}
+
+	fclose(fp);
+}
+
+
+
+void pk2aux_cache_load(void) {
+	pthread_mutex_lock(&cache_lock);
+	if (users++ == 0) {
+		read_cache();
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+static void write_cache(void) {
+	char path_buffer[256], tmp_path[272];
+	const char *path;
+	unsigned int i, j;
+	FILE *fp;
+
+	if (!dirty || !(path = cache_path(path_buffer, sizeof(path_buffer)))) {
+		return;
+	}
+
+	/* Write a new file and rename it over the old one so a reader never sees half a file. */
+	if ((size_t) snprintf(tmp_path, sizeof(tmp_path), "%s.%ld", path, (long) getpid()) >= sizeof(tmp_path)) {
+		return;
+	}
+	if (!(fp = fopen(tmp_path, "w"))) {
+		return;
+	}
+	fputs("# pk2aux device cache: bus-ports@address/bcdDevice firmware eeprom\n", fp);
+	for (i = 0; i < num_entries; ++i) {
+		fprintf(fp, "%s %u.%u.%u ", entries[i].key, entries[i].version[0], entries[i].version[1], entries[i].version[2]);
+		for (j = 0; j < 16; ++j) {
+			fprintf(fp, "%02x", entries[i].eeprom[j]);
+		}
+		fputc('\n', fp);
+	}
+	if (fclose(fp) != 0 || rename(tmp_path, path) != 0) {
+		unlink(tmp_path);
+		return;
+	}
+
+	dirty = 0;
+}
+
+
+
+void pk2aux_cache_save(void) {
+	pthread_mutex_lock(&cache_lock);
+	write_cache();
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+void pk2aux_cache_free(void) {
+	pthread_mutex_lock(&cache_lock);
+	if (users && --users == 0) {
+		free(entries);
+		entries = 0;
+		num_entries = 0;
+		dirty = 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+int pk2aux_cache_lookup(const char *key, unsigned char *version, unsigned char *eeprom) {
+	struct cache_entry *entry;
+	int found = 0;
+
+	pthread_mutex_lock(&cache_lock);
+	if ((entry = find_entry(key))) {
+		memcpy(version, entry->version, 3);
+		memcpy(eeprom, entry->eeprom, 16);
+		entry->present = 1;
+		found = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	return found;
+}
+
+
+
+void pk2aux_cache_store(const char *key, const unsigned char *version, const unsigned char *eeprom) {
+	struct cache_entry *entry, *tmp;
+
+	pthread_mutex_lock(&cache_lock);
+	if (!(entry = find_entry(key))) {
+		if (!(tmp = realloc(entries, (num_entries + 1) * sizeof(*entries)))) {
+			pthread_mutex_unlock(&cache_lock);
+			return;
+		}
+		entries = tmp;
+		entry = &entries[num_entries++];
+		strcpy(entry->key, key);
+	}
+
+	memcpy(entry->version, version, 3);
+	memcpy(entry->eeprom, eeprom, 16);
+	entry->present = 1;
+	dirty = 1;
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+void pk2aux_cache_invalidate(const char *key) {
+	struct cache_entry *entry;
+
+	pthread_mutex_lock(&cache_lock);
+	if ((entry = find_entry(key))) {
+		*entry = entries[--num_entries];
+		dirty = 1;
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
+
+
+
+void pk2aux_cache_prune(void) {
+	unsigned int i = 0;
+
+	/* Whatever a full scan did not look up belongs to a device that has gone away. */
+	pthread_mutex_lock(&cache_lock);
+	while (i < num_entries) {
+		if (entries[i].present) {
+			i++;
+		} else {
+			entries[i] = entries[--num_entries];
+			dirty = 1;
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+}
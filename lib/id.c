@@ -22,9 +22,12 @@
 
 
 
-int pk2aux_set_id(pk2aux_handle handle, const char *id) {
+static int set_id(pk2aux_handle handle, const char *id) {
+	int rc;
 	unsigned char buffer[19];
 
+	handle->api = PK2AUX_API_SET_ID;
+
 	/* Command. */
 	buffer[0] = WR_INTERNAL_EE;
 	/* Start address. */
@@ -46,6 +49,27 @@ int pk2aux_set_id(pk2aux_handle handle, const char *id) {
 		memset(buffer + 3, 0xFF, 16);
 	}
 
-	return pk2aux_write(handle, buffer, 19);
+	if ((rc = pk2aux_write(handle, buffer, 19)) < 0) {
+		return rc;
+	}
+
+	/* Any cached copy of the old ID is now wrong. */
+	if (handle->cache_key[0]) {
+		pk2aux_cache_invalidate(handle->cache_key);
+		pk2aux_cache_save();
+	}
+
+	return 0;
+}
+
+
+
+int pk2aux_set_id(pk2aux_handle handle, const char *id) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_id(handle, id);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
 }
 
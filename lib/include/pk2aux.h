@@ -23,22 +23,45 @@
  * \file
  *
  * \brief Defines the public API that programs can use to call into the library.
+ *
+ * Commands that do not return data are queued to the device without waiting for
+ * their transfers to complete. If such a transfer fails, the error is reported by a
+ * later call on the same handle.
+ *
+ * Each handle remembers the pin modes that have been set through it. Setting PGC, PGD or AUX
+ * to a mode it is already known to be in generates no USB traffic. Reading a pin always asks
+ * the device.
+ *
+ * The functions that do not take a context work on a default context, set up by pk2aux_init()
+ * and torn down by pk2aux_exit(). A program can create further contexts with pk2aux_context_new(),
+ * each with its own device list; handles to devices from any context are used in the same way.
+ * Contexts and handles may be used from any thread, and a handle may be shared by several
+ * threads: each call on a handle completes before the next one on the same handle begins.
+ * pk2aux_init() and pk2aux_exit() themselves must not race with any other call.
  */
 
 #include <stddef.h>
 #include <stdint.h>
 #include <limits.h>
+#include <stdio.h>
+#include <sys/time.h>
+#include <time.h>
 
 
 
 /**
  * \brief Describes one of the PICkit2 devices connected to the system.
+ *
+ * Devices are allocated by the library. A pointer to one stays valid until the context that
+ * found it is freed (by pk2aux_exit() for the default context), even if the device is unplugged
+ * in the meantime; opening an unplugged device fails with \c LIBUSB_ERROR_NO_DEVICE.
  */
 typedef struct pk2aux_device {
 	/**
 	 * \brief The unit ID string burned into the device.
 	 *
-	 * Set to a zero-length string if no unit ID is burned in.
+	 * Set to a zero-length string if no unit ID is burned in, or if the device was found by a
+	 * lazy scan (see \ref PK2AUX_INIT_LAZY) and has not yet been probed.
 	 */
 	char unit_id[16];
 
@@ -69,120 +92,880 @@ typedef struct pk2aux_device_list {
 	 */
 	unsigned int num_devices;
 
-	/**
-	 * \brief The devices.
-	 */
-	pk2aux_device *devices;
-} pk2aux_device_list;
+	/**
+	 * \brief Pointers to the devices.
+	 */
+	pk2aux_device **devices;
+} pk2aux_device_list;
+
+
+
+/**
+ * \brief A handle to an open PICkit2.
+ *
+ * Handles of this type are used to operate on a PICkit2.
+ */
+typedef struct pk2aux_handle_impl *pk2aux_handle;
+
+
+
+/**
+ * \brief A library context, which owns a list of devices.
+ */
+typedef struct pk2aux_context_impl *pk2aux_context;
+
+
+
+/**
+ * \brief A mode into which a pin can be placed.
+ */
+enum PIN_MODE {
+	/**
+	 * \brief The pin is driven to ground.
+	 *
+	 * See the individual pin-control functions for precise electrical details.
+	 */
+	PIN_MODE_GROUNDED,
+
+	/**
+	 * \brief The pin is not driven.
+	 *
+	 * See the individual pin-control functions for precise electrical details.
+	 */
+	PIN_MODE_FLOATING,
+
+	/**
+	 * \brief The pin is driven high.
+	 *
+	 * See the individual pin-control functions for precise electrical details.
+	 */
+	PIN_MODE_HIGH
+};
+
+
+
+/**
+ * \brief Bits identifying the pins of the ICSP interface.
+ */
+enum PK2AUX_PIN {
+	/**
+	 * \brief The VDD pin.
+	 */
+	PK2AUX_PIN_VDD = 0x01,
+
+	/**
+	 * \brief The VPP pin.
+	 */
+	PK2AUX_PIN_VPP = 0x02,
+
+	/**
+	 * \brief The PGC pin.
+	 */
+	PK2AUX_PIN_PGC = 0x04,
+
+	/**
+	 * \brief The PGD pin.
+	 */
+	PK2AUX_PIN_PGD = 0x08,
+
+	/**
+	 * \brief The AUX pin.
+	 */
+	PK2AUX_PIN_AUX = 0x10
+};
+
+
+
+/**
+ * \brief The state of all the pins of a PICkit2, as returned by pk2aux_get_snapshot().
+ */
+typedef struct pk2aux_snapshot {
+	/**
+	 * \brief The voltage measured on the VDD pin, as returned by pk2aux_get_vdd_level().
+	 */
+	double vdd_level;
+
+	/**
+	 * \brief The voltage measured at the VPP boost converter, as returned by pk2aux_get_vpp_level().
+	 */
+	double vpp_level;
+
+	/**
+	 * \brief The logic level of the PGC pin, as returned by pk2aux_get_pgc().
+	 */
+	unsigned int pgc_level;
+
+	/**
+	 * \brief The logic level of the PGD pin, as returned by pk2aux_get_pgd().
+	 */
+	unsigned int pgd_level;
+
+	/**
+	 * \brief The logic level of the AUX pin, as returned by pk2aux_get_aux().
+	 */
+	unsigned int aux_level;
+
+	/**
+	 * \brief A bitmask of \ref PK2AUX_PIN values indicating which of the mode fields below are valid.
+	 *
+	 * The firmware cannot report pin modes directly, so a mode is only known if it can be derived
+	 * from the state of the device or if it was set through this handle.
+	 */
+	unsigned int modes_known;
+
+	/**
+	 * \brief The mode of the VDD pin, valid if \ref PK2AUX_PIN_VDD is set in \ref modes_known.
+	 */
+	enum PIN_MODE vdd_mode;
+
+	/**
+	 * \brief The mode of the VPP pin, valid if \ref PK2AUX_PIN_VPP is set in \ref modes_known.
+	 */
+	enum PIN_MODE vpp_mode;
+
+	/**
+	 * \brief The mode of the PGC pin, valid if \ref PK2AUX_PIN_PGC is set in \ref modes_known.
+	 */
+	enum PIN_MODE pgc_mode;
+
+	/**
+	 * \brief The mode of the PGD pin, valid if \ref PK2AUX_PIN_PGD is set in \ref modes_known.
+	 */
+	enum PIN_MODE pgd_mode;
+
+	/**
+	 * \brief The mode of the AUX pin, valid if \ref PK2AUX_PIN_AUX is set in \ref modes_known.
+	 */
+	enum PIN_MODE aux_mode;
+} pk2aux_snapshot;
+
+
+
+/**
+ * \brief The queries that can be submitted with pk2aux_submit() and collected later.
+ */
+enum PK2AUX_REQUEST {
+	/**
+	 * \brief Reads the firmware version, as pk2aux_get_version() does.
+	 */
+	PK2AUX_REQUEST_VERSION,
+
+	/**
+	 * \brief Measures VDD and VPP, as pk2aux_get_vdd_level() and pk2aux_get_vpp_level() do.
+	 */
+	PK2AUX_REQUEST_VOLTAGES,
+
+	/**
+	 * \brief Samples the logic levels of PGC, PGD and AUX.
+	 *
+	 * Unlike pk2aux_get_pgc() and friends, this always asks the device, even about pins it is
+	 * known to be driving.
+	 */
+	PK2AUX_REQUEST_LEVELS
+};
+
+
+
+/**
+ * \brief Identifies a request submitted with pk2aux_submit() until it is collected.
+ *
+ * Tickets are sequence numbers, issued in increasing order on each handle.
+ */
+typedef unsigned long pk2aux_ticket;
+
+
+
+/**
+ * \brief The answer to a request submitted with pk2aux_submit().
+ *
+ * Only the fields belonging to the request are filled in.
+ */
+typedef struct pk2aux_reply {
+	/**
+	 * \brief The request this is the answer to.
+	 */
+	enum PK2AUX_REQUEST request;
+
+	/**
+	 * \brief The firmware version, for \ref PK2AUX_REQUEST_VERSION.
+	 */
+	unsigned int major, minor, micro;
+
+	/**
+	 * \brief The voltages on VDD and VPP, for \ref PK2AUX_REQUEST_VOLTAGES.
+	 */
+	double vdd_level, vpp_level;
+
+	/**
+	 * \brief The logic levels of PGC, PGD and AUX, for \ref PK2AUX_REQUEST_LEVELS.
+	 */
+	unsigned int pgc_level, pgd_level, aux_level;
+} pk2aux_reply;
+
+
+
+/**
+ * \brief The public functions that talk to a device, for attributing traffic in \ref pk2aux_stats.
+ *
+ * Traffic is attributed to the public function most recently entered on the handle, so
+ * work that one public function does by calling another is counted against the inner one.
+ */
+enum PK2AUX_API {
+	PK2AUX_API_OTHER,
+	PK2AUX_API_OPEN,
+	PK2AUX_API_CLOSE,
+	PK2AUX_API_RESET,
+	PK2AUX_API_BATCH_COMMIT,
+	PK2AUX_API_GET_VERSION,
+	PK2AUX_API_SET_ID,
+	PK2AUX_API_SET_VDD_MODE,
+	PK2AUX_API_SET_VDD_LEVEL,
+	PK2AUX_API_GET_VDD_LEVEL,
+	PK2AUX_API_SET_VPP_MODE,
+	PK2AUX_API_SET_VPP_LEVEL,
+	PK2AUX_API_STOP_VPP_PUMP,
+	PK2AUX_API_GET_VPP_LEVEL,
+	PK2AUX_API_SET_PGC,
+	PK2AUX_API_SET_PGD,
+	PK2AUX_API_SET_AUX,
+	PK2AUX_API_GET_PGC,
+	PK2AUX_API_GET_PGD,
+	PK2AUX_API_GET_AUX,
+	PK2AUX_API_GET_SNAPSHOT,
+	PK2AUX_API_START_UART,
+	PK2AUX_API_STOP_UART,
+	PK2AUX_API_RECEIVE_UART,
+	PK2AUX_API_SEND_UART,
+	PK2AUX_API_REQUEST_UART,
+	PK2AUX_API_SUBMIT,
+	PK2AUX_API_COLLECT,
+	PK2AUX_API_QUEUE_UART,
+	PK2AUX_API_PUMP_UART,
+	PK2AUX_API_FLUSH_UART,
+	PK2AUX_API_UART_PUMP,
+	PK2AUX_API_EXCHANGE_UART,
+
+	/**
+	 * \brief The number of values in this enumeration.
+	 */
+	PK2AUX_API_COUNT
+};
+
+
+
+/**
+ * \brief The number of buckets in a round trip time histogram.
+ */
+#define PK2AUX_STATS_BUCKETS 24
+
+
+
+/**
+ * \brief Traffic counters for one command opcode, one public function, or a whole handle.
+ *
+ * A write is one command passed down to the transport (several may share a packet). A read is
+ * one 64-byte response. Each response is attributed to the command that asked for it, and its
+ * round trip time is measured from when that command was written.
+ */
+typedef struct pk2aux_stats_entry {
+	/**
+	 * \brief The number of commands written.
+	 */
+	unsigned long writes;
+
+	/**
+	 * \brief The number of responses read.
+	 */
+	unsigned long reads;
+
+	/**
+	 * \brief The number of bytes of commands written.
+	 */
+	unsigned long long bytes_written;
+
+	/**
+	 * \brief The number of bytes of responses read.
+	 */
+	unsigned long long bytes_read;
+
+	/**
+	 * \brief The number of writes and reads that failed with LIBUSB_ERROR_TIMEOUT.
+	 */
+	unsigned long timeouts;
+
+	/**
+	 * \brief The number of times waiting for a transfer had to be restarted after being interrupted.
+	 */
+	unsigned long retries;
+
+	/**
+	 * \brief The number of writes and reads that failed other than by timing out.
+	 */
+	unsigned long errors;
+
+	/**
+	 * \brief The sum of all round trip times, in microseconds.
+	 */
+	unsigned long long rtt_total;
+
+	/**
+	 * \brief The longest round trip time, in microseconds.
+	 */
+	unsigned long rtt_max;
+
+	/**
+	 * \brief The median round trip time, in microseconds, as the upper bound of its histogram bucket.
+	 */
+	unsigned long rtt_p50;
+
+	/**
+	 * \brief The 99th percentile round trip time, in microseconds, as the upper bound of its histogram bucket.
+	 */
+	unsigned long rtt_p99;
+
+	/**
+	 * \brief A histogram of round trip times; bucket 0 counts times under 2 microseconds
+	 * and bucket N (for N > 0) times from 2<sup>N</sup> up to 2<sup>N+1</sup> microseconds.
+	 */
+	unsigned long rtt_histogram[PK2AUX_STATS_BUCKETS];
+} pk2aux_stats_entry;
+
+
+
+/**
+ * \brief Traffic counters for a handle, broken down by command opcode and by public function.
+ */
+typedef struct pk2aux_stats {
+	/**
+	 * \brief All traffic on the handle.
+	 */
+	pk2aux_stats_entry total;
+
+	/**
+	 * \brief Traffic by the opcode of the command, indexed by opcode.
+	 */
+	pk2aux_stats_entry opcode[256];
+
+	/**
+	 * \brief Traffic by the public function that caused it, indexed by \ref PK2AUX_API.
+	 */
+	pk2aux_stats_entry api[PK2AUX_API_COUNT];
+
+	/**
+	 * \brief The number of bytes received from the UART.
+	 */
+	unsigned long long uart_bytes_received;
+
+	/**
+	 * \brief The number of times received UART data is suspected to have been lost.
+	 *
+	 * The device silently drops received data its buffer can't hold. This counts the times it
+	 * returned a full block after going unasked for long enough that its buffer could have
+	 * filled up.
+	 */
+	unsigned long uart_overruns;
+} pk2aux_stats;
+
+
+
+/**
+ * \brief Flags that can be passed to pk2aux_init_ex().
+ */
+enum PK2AUX_INIT_FLAGS {
+	/**
+	 * \brief Lists PICkit2s by their USB IDs only, without talking to them.
+	 *
+	 * Each device's firmware version is checked and its unit ID read when it is first opened or
+	 * passed to pk2aux_probe_device(). Programs that operate on a single device should use this
+	 * so that other PICkit2s on the system are not disturbed and do not slow down startup.
+	 */
+	PK2AUX_INIT_LAZY = 0x01,
+
+	/**
+	 * \brief Remembers each PICkit2's unit ID between runs in an inventory cache file.
+	 *
+	 * A device found in the cache is not probed at all; its entry records the firmware version
+	 * as well as the unit ID. Entries are keyed by bus number, port path, device address and
+	 * device release number, so a device that is unplugged or swapped is re-enumerated with a
+	 * new key and probed afresh. Setting a unit ID with pk2aux_set_id() drops that device's
+	 * entry, and the entries of devices that are no longer attached are dropped when the
+	 * system is scanned.
+	 *
+	 * The cache file is named by the \c PK2AUX_CACHE environment variable, or is
+	 * <code>.pk2aux_cache</code> in the user's home directory if that is not set. Setting
+	 * \c PK2AUX_CACHE turns the cache on even if this flag is not given, so that programs which
+	 * leave it off can still be made to use it.
+	 */
+	PK2AUX_INIT_CACHE = 0x02,
+
+	/**
+	 * \brief Leaves each probed PICkit2 claimed so that pk2aux_open() can take it over without any USB traffic.
+	 *
+	 * Devices that are not probed during the scan (because of \ref PK2AUX_INIT_LAZY or
+	 * \ref PK2AUX_INIT_CACHE) are opened normally. Devices that are never opened are released
+	 * by pk2aux_exit(). While a device is held this way, no other program can use it.
+	 */
+	PK2AUX_INIT_KEEP_OPEN = 0x04,
+
+	/**
+	 * \brief Talks to simulated PICkit2s instead of real ones.
+	 *
+	 * The simulator models the firmware's handling of the commands this library uses,
+	 * including the pin and voltage scripts, the EEPROM and the UART (whose transmit line is
+	 * looped back to its receive line), along with the 1 ms frame timing of the USB link, so
+	 * that programs can be exercised without hardware. Simulated devices are on bus 0, at
+	 * addresses starting from 1, and have unit IDs "sim0", "sim1" and so on.
+	 *
+	 * One device is simulated unless the \c PK2AUX_SIM environment variable gives the number
+	 * wanted. Setting that variable to a nonzero number selects the simulator even if this flag
+	 * is not given.
+	 */
+	PK2AUX_INIT_SIMULATED = 0x08
+};
+
+
+
+/**
+ * \brief Initializes libpk2aux and scans the system for PICkit2 devices.
+ *
+ * This function must be called to initialize the library before any other functions are called.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_init(void);
+
+
+
+/**
+ * \brief Initializes libpk2aux and scans the system for PICkit2 devices, with options.
+ *
+ * pk2aux_init() is equivalent to calling this function with \p flags equal to zero.
+ *
+ * If the environment variable PK2AUX_TRACE names a file, every packet exchanged with every
+ * device is recorded there as if by pk2aux_trace_start(). If the environment variable
+ * PK2AUX_REPLAY names such a recording, the devices in it are replayed instead of scanning
+ * for real or simulated ones: the program must send exactly the packets it sent when
+ * recorded, and gets back the same responses with the same timing. Setting
+ * PK2AUX_REPLAY_SPEED to a number replays that many times faster, or without waiting at
+ * all if it is zero.
+ *
+ * \param[in] flags a bitwise OR of \ref PK2AUX_INIT_FLAGS values.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_init_ex(unsigned int flags);
+
+
+
+/**
+ * \brief Starts recording every packet exchanged with any device to a file.
+ *
+ * Each packet is recorded with its direction, its device, the status of the transfer and a
+ * CLOCK_MONOTONIC timestamp, as are the opening and closing of devices. The recording can be
+ * replayed by setting the environment variable PK2AUX_REPLAY as described for
+ * pk2aux_init_ex(). Recording stops at pk2aux_trace_stop(), or when the last context is freed.
+ *
+ * \param[in] path the file to record to, which is overwritten.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_trace_start(const char *path);
+
+
+
+/**
+ * \brief Stops recording packets and closes the recording.
+ */
+void pk2aux_trace_stop(void);
+
+
+
+/**
+ * \brief Deinitializes libpk2aux.
+ *
+ * This function must be called after any other functions.
+ */
+void pk2aux_exit(void);
+
+
+
+/**
+ * \brief Returns the array of located PICkit2 devices.
+ *
+ * The array is a snapshot of the device list, which later hotplug changes do not affect. It
+ * must be freed with pk2aux_free_device_list(); the devices it points to stay valid after that.
+ *
+ * \return the array of found programmers, which is empty if there was no memory to copy it.
+ */
+pk2aux_device_list pk2aux_get_devices(void);
+
+
+
+/**
+ * \brief Frees an array returned by pk2aux_get_devices() or pk2aux_context_get_devices().
+ *
+ * \param[in] dlist the array to free.
+ */
+void pk2aux_free_device_list(pk2aux_device_list dlist);
+
+
+
+/**
+ * \brief Searches the scanned list of PICkit2 devices for the device at the given path.
+ *
+ * \param[in] path the path of the device to look for, in the form <code>"bus_number:device_address"</code>,
+ * or null to find the only device on the system (or fail if multiple devices are attached).
+ * Devices with incompatible firmware do not count; if there are several devices, those not yet
+ * probed are probed to find out.
+ *
+ * \return the device on success or null on failure.
+ */
+pk2aux_device *pk2aux_find_device(const char *path);
+
+
+
+/**
+ * \brief Checks the firmware version of a PICkit2 and reads its unit ID, if that has not been done yet.
+ *
+ * Only devices found by a lazy scan (see \ref PK2AUX_INIT_LAZY) need this.
+ *
+ * \param[in] device the device to probe.
+ *
+ * \return 0 on success or a libusb error code on failure (\c LIBUSB_ERROR_NOT_SUPPORTED if the firmware
+ * is incompatible with this library).
+ */
+int pk2aux_probe_device(pk2aux_device *device);
+
+
+
+/**
+ * \brief The kinds of change reported to a \ref pk2aux_hotplug_callback.
+ */
+enum PK2AUX_HOTPLUG_EVENT {
+	/**
+	 * \brief A PICkit2 was plugged in and has been added to the device list.
+	 */
+	PK2AUX_HOTPLUG_ARRIVED,
+
+	/**
+	 * \brief A PICkit2 was unplugged and has been removed from the device list.
+	 */
+	PK2AUX_HOTPLUG_LEFT
+};
+
+
+
+/**
+ * \brief An application function notified of changes to the device list.
+ *
+ * \param[in] device the device that arrived or left, which stays valid until the context is freed.
+ *
+ * \param[in] event what happened to the device.
+ *
+ * \param[in] user_data the pointer passed to pk2aux_hotplug_start().
+ */
+typedef void (*pk2aux_hotplug_callback)(const pk2aux_device *device, enum PK2AUX_HOTPLUG_EVENT event, void *user_data);
+
+
+
+/**
+ * \brief Starts keeping the device list up to date as PICkit2s are plugged in and unplugged.
+ *
+ * Changes are only applied to the device list, and the callback only invoked, from within
+ * pk2aux_hotplug_poll(). A newly arrived device is probed (or not) as pk2aux_init_ex() was asked to.
+ * Handles to other devices are unaffected; a handle to a device that is unplugged simply fails.
+ *
+ * \param[in] callback the function to notify of changes, or null for none.
+ *
+ * \param[in] user_data a pointer passed to \p callback.
+ *
+ * \return 0 on success or a libusb error code on failure (\c LIBUSB_ERROR_NOT_SUPPORTED if the
+ * platform cannot report hotplug events).
+ */
+int pk2aux_hotplug_start(pk2aux_hotplug_callback callback, void *user_data);
+
+
+
+/**
+ * \brief Stops tracking plugged and unplugged devices.
+ *
+ * This is done automatically by pk2aux_exit().
+ */
+void pk2aux_hotplug_stop(void);
+
+
+
+/**
+ * \brief Waits for devices to be plugged in or unplugged, and updates the device list.
+ *
+ * Device pointers, arrays returned by pk2aux_get_devices() and open handles all stay valid,
+ * though an array does not reflect changes made after it was returned. The callback is made
+ * without the device list locked, so it may look up or open devices itself.
+ *
+ * \param[in] timeout the longest time to wait for events, in milliseconds, or zero to only apply
+ * changes that have already happened.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_hotplug_poll(unsigned int timeout);
+
+
+
+/**
+ * \brief A file descriptor that an application's event loop should watch on the library's behalf.
+ */
+typedef struct pk2aux_pollfd {
+	/**
+	 * \brief The file descriptor.
+	 */
+	int fd;
+
+	/**
+	 * \brief The events to wait for, as for \c poll().
+	 */
+	short events;
+} pk2aux_pollfd;
+
+
+
+/**
+ * \brief Returns the file descriptors that become ready when USB transfers complete.
+ *
+ * Together with pk2aux_get_timeout() and pk2aux_handle_events(), this lets an application wait
+ * for any number of devices alongside its own file descriptors in a single \c poll(),
+ * \c select() or \c epoll set. Whenever one of these descriptors is ready or the timeout
+ * expires, call pk2aux_handle_events(). The set can change as devices are opened and
+ * closed, so fetch it again after doing either.
+ *
+ * Simulated and replayed devices have no file descriptors; see pk2aux_get_timeout().
+ *
+ * \param[out] fds where to store the file descriptors.
+ *
+ * \param[in] size the number of elements in \p fds.
+ *
+ * \return the number of file descriptors, which may exceed \p size if \p fds is too small, or a
+ * libusb error code on failure.
+ */
+int pk2aux_get_pollfds(pk2aux_pollfd *fds, unsigned int size);
+
+
+
+/**
+ * \brief Returns how long an event loop may wait before calling pk2aux_handle_events().
+ *
+ * Simulated and replayed devices cannot wake an event loop, so while they are in use this
+ * always asks to be called again after one USB frame (1 millisecond).
+ *
+ * \param[out] tv the longest time to wait, if there is a limit.
+ *
+ * \return 1 if \p tv was set, 0 if there is no limit, or a libusb error code on failure.
+ */
+int pk2aux_get_timeout(struct timeval *tv);
+
+
+
+/**
+ * \brief Processes whatever USB events have happened, without waiting.
+ *
+ * Completed transfers are noted against their handles, so that pk2aux_uart_ready() can see
+ * them. If pk2aux_hotplug_start() has been called, plugging and unplugging is noticed but only
+ * queued, to be applied to the device list by the next pk2aux_hotplug_poll(), so no new device
+ * is probed here.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_handle_events(void);
+
+
+
+/**
+ * \brief Creates a library context and scans the system for PICkit2 devices.
+ *
+ * This is like pk2aux_init_ex(), but the new context is independent of the default one and of
+ * any others. Opening the same PICkit2 from two contexts at once fails as it would within one.
+ *
+ * \param[out] ctx the new context.
+ *
+ * \param[in] flags a bitwise OR of \ref PK2AUX_INIT_FLAGS values.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_context_new(pk2aux_context *ctx, unsigned int flags);
+
+
+
+/**
+ * \brief Frees a library context.
+ *
+ * All handles to the context's devices must have been closed first.
+ *
+ * \param[in] ctx the context to free.
+ */
+void pk2aux_context_free(pk2aux_context ctx);
+
+
+
+/**
+ * \brief Returns the default context.
+ *
+ * \return the context used by the functions that do not take one, or null if pk2aux_init() has
+ * not been called.
+ */
+pk2aux_context pk2aux_get_default_context(void);
+
+
+
+/**
+ * \brief Returns the array of PICkit2 devices located by a context.
+ *
+ * \param[in] ctx the context.
+ *
+ * \return the array of found programmers, as for pk2aux_get_devices().
+ */
+pk2aux_device_list pk2aux_context_get_devices(pk2aux_context ctx);
+
+
+
+/**
+ * \brief Finds a PICkit2 device in a context.
+ *
+ * \param[in] ctx the context.
+ *
+ * \param[in] path the path to the device, as for pk2aux_find_device().
+ *
+ * \return the device, or null if it was not found.
+ */
+pk2aux_device *pk2aux_context_find_device(pk2aux_context ctx, const char *path);
+
+
+
+/**
+ * \brief Starts keeping a context's device list up to date, as pk2aux_hotplug_start() does.
+ */
+int pk2aux_context_hotplug_start(pk2aux_context ctx, pk2aux_hotplug_callback callback, void *user_data);
+
+
+
+/**
+ * \brief Stops tracking plugged and unplugged devices for a context, as pk2aux_hotplug_stop() does.
+ */
+void pk2aux_context_hotplug_stop(pk2aux_context ctx);
+
+
+
+/**
+ * \brief Applies plugging and unplugging to a context's device list, as pk2aux_hotplug_poll() does.
+ */
+int pk2aux_context_hotplug_poll(pk2aux_context ctx, unsigned int timeout);
 
 
 
 /**
- * \brief A handle to an open PICkit2.
- *
- * Handles of this type are used to operate on a PICkit2.
+ * \brief Returns a context's file descriptors, as pk2aux_get_pollfds() does.
  */
-typedef struct pk2aux_handle_impl *pk2aux_handle;
+int pk2aux_context_get_pollfds(pk2aux_context ctx, pk2aux_pollfd *fds, unsigned int size);
 
 
 
 /**
- * \brief A mode into which a pin can be placed.
+ * \brief Returns how long to wait before handling a context's events, as pk2aux_get_timeout() does.
  */
-enum PIN_MODE {
-	/**
-	 * \brief The pin is driven to ground.
-	 *
-	 * See the individual pin-control functions for precise electrical details.
-	 */
-	PIN_MODE_GROUNDED,
+int pk2aux_context_get_timeout(pk2aux_context ctx, struct timeval *tv);
 
-	/**
-	 * \brief The pin is not driven.
-	 *
-	 * See the individual pin-control functions for precise electrical details.
-	 */
-	PIN_MODE_FLOATING,
 
-	/**
-	 * \brief The pin is driven high.
-	 *
-	 * See the individual pin-control functions for precise electrical details.
-	 */
-	PIN_MODE_HIGH
-};
+
+/**
+ * \brief Processes a context's USB events without waiting, as pk2aux_handle_events() does.
+ */
+int pk2aux_context_handle_events(pk2aux_context ctx);
 
 
 
 /**
- * \brief Initializes libpk2aux and scans the system for PICkit2 devices.
+ * \brief Opens a PICkit2.
  *
- * This function must be called to initialize the library before any other functions are called.
+ * \param[in] device the device to open.
+ *
+ * \param[out] handle the device handle that can be used to operate on the device.
  *
  * \return 0 on success or a libusb error code on failure.
  */
-int pk2aux_init(void);
+int pk2aux_open(pk2aux_device *device, pk2aux_handle *handle);
 
 
 
 /**
- * \brief Deinitializes libpk2aux.
+ * \brief Closes an open handle.
  *
- * This function must be called after any other functions.
+ * \param[in] handle the handle to close, which becomes invalid.
  */
-void pk2aux_exit(void);
+void pk2aux_close(pk2aux_handle handle);
 
 
 
 /**
- * \brief Returns the array of located PICkit2 devices.
+ * \brief Resets the PICkit2.
  *
- * \return the array of found programmers.
+ * \param[in] handle the handle of the device to reset, which becomes invalid.
  */
-pk2aux_device_list pk2aux_get_devices(void);
+void pk2aux_reset(pk2aux_handle handle);
 
 
 
 /**
- * \brief Searches the scanned list of PICkit2 devices for the device at the given path.
+ * \brief Sets the timeout applied to each USB transfer made through a handle.
  *
- * \param[in] path the path of the device to look for, in the form <code>"bus_number:device_address"</code>,
- * or null to find the only device on the system (or fail if multiple devices are attached).
+ * The default is 1000 milliseconds.
  *
- * \return the device on success or null on failure.
+ * \param[in] handle the handle whose timeout should be set.
+ *
+ * \param[in] timeout the timeout, in milliseconds, or 0 to wait indefinitely.
  */
-pk2aux_device *pk2aux_find_device(const char *path);
+void pk2aux_set_timeout(pk2aux_handle handle, unsigned int timeout);
 
 
 
 /**
- * \brief Opens a PICkit2.
+ * \brief Sets an absolute deadline for all operations on a handle.
  *
- * \param[in] device the device to open.
+ * Once the deadline has passed, operations that have to talk to the device fail with
+ * LIBUSB_ERROR_TIMEOUT, and transfers still in flight at that moment are cancelled. The
+ * deadline applies in addition to the per-transfer timeout, and stays in effect until it is
+ * changed or cleared. Closing or resetting the handle ignores it.
  *
- * \param[out] handle the device handle that can be used to operate on the device.
+ * \param[in] handle the handle whose deadline should be set.
  *
- * \return 0 on success or a libusb error code on failure.
+ * \param[in] deadline the deadline, measured on \c CLOCK_MONOTONIC, or NULL to clear it.
  */
-int pk2aux_open(pk2aux_device *device, pk2aux_handle *handle);
+void pk2aux_set_deadline(pk2aux_handle handle, const struct timespec *deadline);
 
 
 
 /**
- * \brief Closes an open handle.
+ * \brief Starts batching commands.
  *
- * \param[in] handle the handle to close, which becomes invalid.
+ * While a batch is open, commands that do not return data are appended to a single packet
+ * instead of each being sent in its own USB transaction. The packet is sent when the next
+ * command does not fit in it, when the batch is committed, or when a command that returns data
+ * is issued (the response is then read and returned to that command's caller as usual).
+ * Commands are always delivered to the device in the order they were issued.
+ *
+ * Batches may be nested; the packet is only committed when the outermost batch is committed.
+ *
+ * \param[in] handle the handle of the device whose commands should be batched.
  */
-void pk2aux_close(pk2aux_handle handle);
+void pk2aux_batch_begin(pk2aux_handle handle);
 
 
 
 /**
- * \brief Resets the PICkit2.
+ * \brief Ends a batch started by pk2aux_batch_begin(), sending any commands still held back.
  *
- * \param[in] handle the handle of the device to reset, which becomes invalid.
+ * \param[in] handle the handle of the device whose batch should be committed.
+ *
+ * \return 0 on success or a libusb error code on failure.
  */
-void pk2aux_reset(pk2aux_handle handle);
+int pk2aux_batch_commit(pk2aux_handle handle);
 
 
 
@@ -427,6 +1210,21 @@ int pk2aux_get_aux(pk2aux_handle handle, unsigned int *level);
 
 
 
+/**
+ * \brief Reads the levels of all the pins, and whatever modes are known, at once.
+ *
+ * This costs a single USB round trip, whereas calling the individual query functions costs one each.
+ *
+ * \param[in] handle the handle of the device to inspect.
+ *
+ * \param[out] snapshot the state of the pins.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_get_snapshot(pk2aux_handle handle, pk2aux_snapshot *snapshot);
+
+
+
 /**
  * \brief Initiates UART mode.
  *
@@ -451,9 +1249,74 @@ int pk2aux_stop_uart(pk2aux_handle handle);
 
 
 
+/**
+ * \brief Queues a query to the device without waiting for its answer.
+ *
+ * The firmware answers commands in the order it receives them, so any number of queries can be
+ * in flight at once and their answers matched up as they arrive. Submitting several queries before
+ * collecting any keeps the USB pipe full, so that one programmer can deliver close to one answer
+ * per USB frame; submitting them between pk2aux_batch_begin() and pk2aux_batch_commit() packs
+ * their commands into as few packets as possible.
+ *
+ * Other functions may be called on the handle while queries are outstanding. Any that need an
+ * answer of their own first read the answers to the outstanding queries, which are kept until
+ * they are collected.
+ *
+ * \param[in] handle the handle of the device to query.
+ *
+ * \param[in] request what to ask.
+ *
+ * \param[out] ticket identifies the query to pk2aux_collect().
+ *
+ * \return 0 on success or a libusb error code on failure (\c LIBUSB_ERROR_BUSY if too many
+ * queries are waiting to be collected).
+ */
+int pk2aux_submit(pk2aux_handle handle, enum PK2AUX_REQUEST request, pk2aux_ticket *ticket);
+
+
+
+/**
+ * \brief Waits for the answer to a query submitted with pk2aux_submit().
+ *
+ * Queries may be collected in any order. Each ticket can only be collected once.
+ *
+ * \param[in] handle the handle the query was submitted on.
+ *
+ * \param[in] ticket the query's ticket.
+ *
+ * \param[out] reply the answer.
+ *
+ * \return 0 on success or a libusb error code on failure (\c LIBUSB_ERROR_NOT_FOUND if the ticket
+ * is not outstanding).
+ */
+int pk2aux_collect(pk2aux_handle handle, pk2aux_ticket ticket, pk2aux_reply *reply);
+
+
+
+/**
+ * \brief Checks whether pk2aux_collect() would return without waiting for the device.
+ *
+ * Call pk2aux_handle_events() first to notice arrivals.
+ *
+ * \param[in] handle the handle the query was submitted on.
+ *
+ * \param[in] ticket the query's ticket.
+ *
+ * \return 1 if so or 0 if not.
+ */
+int pk2aux_reply_ready(pk2aux_handle handle, pk2aux_ticket ticket);
+
+
+
 /**
  * \brief Retrieves received data from the UART.
  *
+ * Received data is kept in a receive ring in the handle, and whatever is there is returned without
+ * asking the device for more. Only once the ring is empty is the device asked; it returns at most 63
+ * bytes at a time, so it is asked again for as long as it keeps returning full blocks, \p buffer has
+ * room for more and so does the ring. Whatever does not fit in \p buffer stays in the ring for next
+ * time.
+ *
  * \param[in] handle the handle of the device from which to read data.
  *
  * \param[out] buffer the buffer into which to store the data.
@@ -466,9 +1329,45 @@ int pk2aux_receive_uart(pk2aux_handle handle, void *buffer, size_t *length);
 
 
 
+/**
+ * \brief Asks the device for received UART data without waiting for the answer.
+ *
+ * The PICkit2 only reports what its UART has received when asked. This sends the question, so
+ * that an event loop can go on to wait in pk2aux_get_pollfds() and the answer can be collected
+ * by pk2aux_receive_uart() once pk2aux_uart_ready() says it has arrived. Any other call on the
+ * handle that reads from the device first puts the answer in the handle's receive ring. Asking
+ * again before the answer is collected does nothing, as does asking while the handle's receive
+ * ring has no room for a whole answer.
+ *
+ * \param[in] handle the handle of the device to ask.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_request_uart(pk2aux_handle handle);
+
+
+
+/**
+ * \brief Checks whether pk2aux_receive_uart() would return without waiting for the device.
+ *
+ * This is the case if data is buffered in the handle, the handle is not in UART mode, or the
+ * answer to pk2aux_request_uart() has arrived. Call pk2aux_handle_events() first to notice
+ * arrivals.
+ *
+ * \param[in] handle the handle of the device to check.
+ *
+ * \return 1 if so or 0 if not.
+ */
+int pk2aux_uart_ready(pk2aux_handle handle);
+
+
+
 /**
  * \brief Sends data to the UART.
  *
+ * Anything queued by pk2aux_queue_uart() is sent first. The call returns once all the data has
+ * been handed to the device, which it is as fast as the device's buffer empties onto the wire.
+ *
  * \param[in] handle the handle of the device to which to send data.
  *
  * \param[in] buffer the data to send.
@@ -481,6 +1380,206 @@ int pk2aux_send_uart(pk2aux_handle handle, const void *buffer, size_t length);
 
 
 
+/**
+ * \brief Sends data to the UART, giving up at a deadline.
+ *
+ * This behaves like pk2aux_send_uart(), except that \p deadline replaces the handle's deadline
+ * for the duration of the call. The pacing delays that keep the device's buffer from
+ * overflowing are cut short at the deadline, and no further data is sent after it.
+ *
+ * \param[in] handle the handle of the device to which to send data.
+ *
+ * \param[in] buffer the data to send.
+ *
+ * \param[in,out] length on call, the number of bytes to send; on return, the number of bytes actually sent.
+ *
+ * \param[in] deadline the deadline, measured on \c CLOCK_MONOTONIC, or NULL for none.
+ *
+ * \return 0 if all the data was sent, LIBUSB_ERROR_TIMEOUT if the deadline passed first, or another libusb error code on failure.
+ */
+int pk2aux_send_uart_until(pk2aux_handle handle, const void *buffer, size_t *length, const struct timespec *deadline);
+
+
+
+/**
+ * \brief Sends data to the UART and retrieves received data in a single transaction.
+ *
+ * Up to 61 bytes of \p tx are sent in the same packet as the question asking the device what
+ * its UART has received, so one round trip does the work of a pk2aux_send_uart() followed by a
+ * pk2aux_receive_uart(). This suits request-and-response traffic, where each exchange sends the
+ * next request and collects whatever has arrived so far. Anything queued by pk2aux_queue_uart()
+ * is sent first, and the call waits for room in the device's buffer if need be. Data already in
+ * the receive ring is returned ahead of the new answer, and whatever does not fit in \p rx stays
+ * in the ring for next time.
+ *
+ * \param[in] handle the handle of the device with which to exchange data.
+ *
+ * \param[in] tx the data to send.
+ *
+ * \param[in,out] tx_length on call, the number of bytes to send; on return, the number of bytes actually sent.
+ *
+ * \param[out] rx the buffer into which to store received data.
+ *
+ * \param[in,out] rx_length on call, the amount of space in \p rx; on return, the number of bytes returned.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_exchange_uart(pk2aux_handle handle, const void *tx, size_t *tx_length, void *rx, size_t *rx_length);
+
+
+
+/**
+ * \brief Queues data for the UART without waiting.
+ *
+ * The data is taken into a transmit ring of 4096 bytes in the handle, and handed to the device as
+ * its buffer empties. The device cannot say how full its buffer is, so how fast it empties is
+ * worked out from the baud rate, a little conservatively. Queued data moves on whenever this,
+ * pk2aux_pump_uart(), pk2aux_request_uart() or pk2aux_receive_uart() is called.
+ *
+ * \param[in] handle the handle of the device to which to send data.
+ *
+ * \param[in] buffer the data to queue.
+ *
+ * \param[in,out] length on call, the number of bytes to queue; on return, the number of bytes taken, which is less if the ring filled up.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_queue_uart(pk2aux_handle handle, const void *buffer, size_t *length);
+
+
+
+/**
+ * \brief Hands as much queued UART data to the device as it has room for, without waiting.
+ *
+ * \param[in] handle the handle of the device to which to send data.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_pump_uart(pk2aux_handle handle);
+
+
+
+/**
+ * \brief Waits until all queued UART data has been handed to the device.
+ *
+ * The handle's deadline, if any, is honoured; data not yet handed over when it passes stays queued.
+ *
+ * \param[in] handle the handle of the device to which to send data.
+ *
+ * \return 0 on success, LIBUSB_ERROR_TIMEOUT if the deadline passed first, or another libusb error code on failure.
+ */
+int pk2aux_flush_uart(pk2aux_handle handle);
+
+
+
+/**
+ * \brief Reports how much UART data is queued, and when the device will have room for more.
+ *
+ * An event loop can use this to know when to call pk2aux_pump_uart() next.
+ *
+ * \param[in] handle the handle of the device to check.
+ *
+ * \param[out] tv if not NULL and data is queued, how long until pk2aux_pump_uart() can hand more of it over.
+ *
+ * \return the number of bytes queued.
+ */
+size_t pk2aux_uart_queued(pk2aux_handle handle, struct timeval *tv);
+
+
+
+/**
+ * \brief Sets the size of a handle's UART receive ring.
+ *
+ * The ring starts out holding 4096 bytes. Data already in it is kept.
+ *
+ * \param[in] handle the handle whose ring to resize.
+ *
+ * \param[in] size the new size in bytes, which must be a power of two of at least 64 and no less than the amount of data in the ring.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_set_uart_buffer_size(pk2aux_handle handle, size_t size);
+
+
+
+/**
+ * \brief Starts a thread that keeps collecting received UART data in the background.
+ *
+ * The device only holds 128 received bytes, and drops any more without telling anyone, so an
+ * application that is slow to call pk2aux_receive_uart() loses data at higher baud rates. The pump
+ * thread instead asks the device for data whenever the handle's receive ring has room, as often as
+ * the baud rate calls for, and also keeps data queued by pk2aux_queue_uart() moving.
+ * pk2aux_receive_uart() then returns what the pump has collected. If the pump fails, it stops, and
+ * pk2aux_receive_uart() returns the error once the ring is empty.
+ *
+ * The pump runs until pk2aux_stop_uart_pump(), pk2aux_stop_uart(), pk2aux_reset() or pk2aux_close()
+ * is called, and only does anything while the handle is in UART mode. Starting it when it is
+ * already running does nothing. Starting it after it has stopped on an error starts a new pump,
+ * and any error not yet returned by pk2aux_receive_uart() is forgotten.
+ *
+ * \param[in] handle the handle whose UART to pump.
+ *
+ * \return 0 on success or a libusb error code on failure.
+ */
+int pk2aux_start_uart_pump(pk2aux_handle handle);
+
+
+
+/**
+ * \brief Stops the receive pump thread, if it is running, and waits for it to finish.
+ *
+ * \param[in] handle the handle whose pump to stop.
+ */
+void pk2aux_stop_uart_pump(pk2aux_handle handle);
+
+
+
+/**
+ * \brief Retrieves the traffic counters of a handle.
+ *
+ * Counting starts when the handle is opened, or when it was last reset by pk2aux_reset_stats().
+ *
+ * \param[in] handle the handle whose counters to retrieve.
+ *
+ * \param[out] stats the counters, with the percentiles filled in.
+ */
+void pk2aux_get_stats(pk2aux_handle handle, pk2aux_stats *stats);
+
+
+
+/**
+ * \brief Sets all the traffic counters of a handle back to zero.
+ *
+ * \param[in] handle the handle whose counters to reset.
+ */
+void pk2aux_reset_stats(pk2aux_handle handle);
+
+
+
+/**
+ * \brief Writes the traffic counters of a handle to a stream in human-readable form.
+ *
+ * Only opcodes and functions that saw any traffic are listed.
+ *
+ * \param[in] handle the handle whose counters to write.
+ *
+ * \param[in] stream the stream to write to.
+ */
+void pk2aux_dump_stats(pk2aux_handle handle, FILE *stream);
+
+
+
+/**
+ * \brief Returns the name of a public function as listed in \ref PK2AUX_API.
+ *
+ * \param[in] api the function.
+ *
+ * \return the function's name, without the pk2aux_ prefix.
+ */
+const char *pk2aux_api_name(enum PK2AUX_API api);
+
+
+
 /**
  * \brief Returns a string error message corresponding to a libusb error code.
  *
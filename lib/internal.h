@@ -21,19 +21,234 @@
 
 #include "pk2aux.h"
 #include <libusb.h>
+#include <pthread.h>
+#include <time.h>
 
-struct pk2aux_handle_impl {
+/* The size of a device's key in the inventory cache, including the terminator. */
+#define PK2AUX_CACHE_KEY_SIZE 40
+
+/* The number of transfers the engine keeps available in each direction. */
+#define PK2AUX_NUM_TRANSFERS 4
+
+/* The default timeout applied to each individual USB transfer, in milliseconds. */
+#define PK2AUX_TRANSFER_TIMEOUT 1000
+
+struct pk2aux_device_private;
+struct pk2aux_engine;
+struct pk2aux_sim;
+struct pk2aux_replay;
+
+/* The operations through which packets reach one kind of device. open() and close()
+ * claim and give back the device itself, while start() and stop() set up and tear down
+ * the packet queues of a claimed device, so a session can be parked between the two.
+ * reserve() hands out the buffer of the next OUT packet, waiting for one to be free,
+ * and submit() sends the first length bytes of it, padded out. Nothing else may
+ * happen on the engine in between. The other packet operations behave as described
+ * for pk2aux_engine_read() and friends. */
+struct pk2aux_transport {
+	int (*open)(struct pk2aux_device_private *device, struct pk2aux_engine *engine);
+	void (*close)(struct pk2aux_engine *engine, int reset);
+	int (*start)(struct pk2aux_engine *engine);
+	void (*stop)(struct pk2aux_engine *engine);
+	int (*reserve)(struct pk2aux_engine *engine, unsigned char **buffer);
+	int (*submit)(struct pk2aux_engine *engine, size_t length);
+	int (*read)(struct pk2aux_engine *engine, void *data);
+	int (*flush)(struct pk2aux_engine *engine);
+	int (*ready)(struct pk2aux_engine *engine);
+};
+
+extern const struct pk2aux_transport pk2aux_usb_transport;
+extern const struct pk2aux_transport pk2aux_sim_transport;
+extern const struct pk2aux_transport pk2aux_replay_transport;
+
+/* The kinds of record in a packet trace. */
+#define PK2AUX_TRACE_OPEN 0
+#define PK2AUX_TRACE_CLOSE 1
+#define PK2AUX_TRACE_OUT 2
+#define PK2AUX_TRACE_IN 3
+
+/* The size of one record in a packet trace: an 8-byte CLOCK_MONOTONIC timestamp in
+ * nanoseconds, the record type, bus number, device address, a reserved byte, a 4-byte
+ * status, and the 64-byte packet, all little-endian. */
+#define PK2AUX_TRACE_RECORD_SIZE 80
+
+/* One asynchronous transfer slot and the packet buffer it transfers. The buffer is
+ * device memory if libusb could provide it, and the slot's own storage otherwise. */
+struct pk2aux_transfer {
+	struct libusb_transfer *transfer;
+	unsigned char *buffer;
+	unsigned char storage[64];
+	int pending, completed, status;
+};
+
+/* The packet engine of one open device. OUT packets are submitted without waiting for
+ * earlier ones to complete; IN transfers stay posted all the time and are consumed in
+ * order as their completions arrive. No write or read is given longer than the timeout,
+ * nor allowed to run past the deadline if there is one. The USB fields are used by the
+ * USB transport, the simulator by the simulated one and the replay by the replay one.
+ * The bus number and address identify the device in traces, and reserved is the OUT
+ * buffer handed out by pk2aux_engine_reserve(). */
+struct pk2aux_engine {
+	const struct pk2aux_transport *transport;
+	unsigned int timeout;
+	int has_deadline;
+	struct timespec deadline;
+	/* How many libusb event waits were interrupted and had to be restarted. */
+	unsigned long retries;
+	libusb_context *usb_context;
 	libusb_device_handle *usb_handle;
-	int original_configuration;
-	unsigned int pgc_floating, pgd_floating, uart_enabled, uart_baud;
-	unsigned char uart_buffer[63];
-	size_t uart_buffer_used;
+	int original_config;
+	struct pk2aux_transfer out[PK2AUX_NUM_TRANSFERS];
+	struct pk2aux_transfer in[PK2AUX_NUM_TRANSFERS];
+	unsigned int out_next, in_head;
+	unsigned char *dev_mem;
+	struct pk2aux_sim *sim;
+	struct pk2aux_replay *replay;
+	uint8_t bus_number, device_address;
+	unsigned char *reserved;
+};
+
+/* What pk2aux_device.private_data points at. Probed is set once the firmware version has been
+ * found compatible and the unit ID read, and incompatible once it has been found not to be.
+ * Gone is set once the device has been unplugged; next then chains it to the context's other
+ * unplugged devices. The cache key is empty if caching is off. If the probe left the device
+ * claimed, the pooled engine holds that (stopped) session and the pooled state the TRISA and
+ * ICSP_STATES_BUFFER bytes it read, for pk2aux_open() to adopt. */
+struct pk2aux_device_private {
+	pk2aux_context context;
+	const struct pk2aux_transport *transport;
+	libusb_context *usb_context;
+	libusb_device *usb_device;
+	struct pk2aux_sim *sim;
+	struct pk2aux_replay *replay;
+	unsigned int probed, incompatible, gone;
+	pk2aux_device *next;
+	char cache_key[PK2AUX_CACHE_KEY_SIZE];
+	int pooled;
+	struct pk2aux_engine pooled_engine;
+	unsigned char pooled_pg_state[2];
+};
+
+/* The pin modes this library has written to the device, with a PK2AUX_PIN bit set in known for
+ * each one that is valid, so that setters need not read the device back and can skip writes
+ * that would not change anything. The firmware turns VDD and VPP off by itself on a fault, so
+ * their modes are only recorded for snapshots and are always written. */
+struct pk2aux_shadow {
+	unsigned int known;
+	enum PIN_MODE vdd_mode, vpp_mode, pgc_mode, pgd_mode, aux_mode;
+};
+
+/* The most queries that can be submitted on a handle and not yet collected. */
+#define PK2AUX_MAX_PENDING 32
+
+/* The most answers the statistics keep track of before they have been read. */
+#define PK2AUX_MAX_EXPECTED 64
+
+/* The size of the UART transmit ring of a handle, and the initial size of its receive ring. */
+#define PK2AUX_UART_TX_SIZE 4096
+#define PK2AUX_UART_RX_SIZE 4096
+
+/* A query submitted with pk2aux_submit() at time submitted, in microseconds, and its answer
+ * once that has been read. An entry may instead stand for UART data asked for by
+ * pk2aux_request_uart(). */
+struct pk2aux_pending {
+	enum PK2AUX_REQUEST request;
+	int uart;
+	int collected;
+	int status;
+	long long submitted;
+	unsigned char response[64];
+};
+
+/* A command written to the device whose answer has not been read yet, for the statistics. */
+struct pk2aux_expected {
+	unsigned char opcode;
+	long long written;
+};
+
+/* Every public function taking a handle holds its lock throughout, so a handle can be
+ * shared between threads. The lock is recursive since those functions call each other.
+ * The pending ring holds the queries from ticket pending_first on, of which the first
+ * pending_arrived have been answered. Commands are built straight into the OUT packet
+ * reserved from the engine, batch_packet, of which batch_used bytes are filled so far;
+ * outside a batch the packet goes off as soon as its command is in. The UART transmit
+ * ring holds uart_tx_used bytes from uart_tx_head on, and the receive ring, whose size is
+ * a power of two, likewise; uart_tx_level is how many bytes the
+ * device's download buffer was reckoned to hold at uart_tx_time, in microseconds. uart_asked
+ * is when the device was last asked for received data, and uart_gap how long it had been
+ * since the time before, and uart_requested is set while its answer is in the pending
+ * ring. The receive pump thread, if running, waits on uart_pump_wake with the lock
+ * between fetches, and sets uart_pump_exited as it finishes, having failed with
+ * uart_pump_error or been told to stop. The expected ring holds the expected_count commands, from
+ * expected_first on, whose answers the statistics are still waiting for. */
+struct pk2aux_handle_impl {
+	pthread_mutex_t lock;
+	struct pk2aux_engine engine;
+	struct pk2aux_shadow shadow;
+	unsigned int uart_enabled, uart_baud;
+	unsigned char *uart_rx;
+	size_t uart_rx_size, uart_rx_head, uart_rx_used;
+	int uart_requested;
+	unsigned char uart_tx[PK2AUX_UART_TX_SIZE];
+	size_t uart_tx_head, uart_tx_used;
+	double uart_tx_level;
+	long long uart_tx_time;
+	long long uart_asked, uart_gap;
+	pthread_t uart_pump;
+	pthread_cond_t uart_pump_wake;
+	int uart_pump_running, uart_pump_stop, uart_pump_exited, uart_pump_error;
+	struct pk2aux_pending pending[PK2AUX_MAX_PENDING];
+	pk2aux_ticket pending_first;
+	unsigned int pending_count, pending_arrived;
+	unsigned int batch_depth;
+	unsigned char *batch_packet;
+	size_t batch_used;
+	char cache_key[PK2AUX_CACHE_KEY_SIZE];
+	uint8_t bus_number, device_address;
+	enum PK2AUX_API api;
+	struct pk2aux_expected expected[PK2AUX_MAX_EXPECTED];
+	unsigned int expected_first, expected_count;
+	pk2aux_stats stats;
 };
 
-extern int pk2aux_write_usb(libusb_device_handle *handle, const void *data, size_t length);
+extern int pk2aux_cache_key(libusb_device *device, char *key);
+extern void pk2aux_cache_load(void);
+extern void pk2aux_cache_save(void);
+extern void pk2aux_cache_free(void);
+extern int pk2aux_cache_lookup(const char *key, unsigned char *version, unsigned char *eeprom);
+extern void pk2aux_cache_store(const char *key, const unsigned char *version, const unsigned char *eeprom);
+extern void pk2aux_cache_invalidate(const char *key);
+extern void pk2aux_cache_prune(void);
+extern struct pk2aux_sim *pk2aux_sim_new(unsigned int index);
+extern void pk2aux_sim_free(struct pk2aux_sim *sim);
+extern void pk2aux_trace_record(const struct pk2aux_engine *engine, unsigned int type, int status, const void *data, size_t length);
+extern int pk2aux_replay_load(const char *path, struct pk2aux_replay **replays, unsigned int *count);
+extern struct pk2aux_replay *pk2aux_replay_device(struct pk2aux_replay *replays, unsigned int index, pk2aux_device *device, unsigned int *probed);
+extern void pk2aux_replay_free(struct pk2aux_replay *replays, unsigned int count);
+extern int pk2aux_engine_open(pk2aux_device *device, struct pk2aux_engine *engine);
+extern void pk2aux_engine_close(struct pk2aux_engine *engine, int reset);
+extern int pk2aux_engine_start(struct pk2aux_engine *engine);
+extern void pk2aux_engine_stop(struct pk2aux_engine *engine);
+extern int pk2aux_engine_flush(struct pk2aux_engine *engine);
+extern int pk2aux_engine_ready(struct pk2aux_engine *engine);
+extern int pk2aux_engine_time_left(const struct pk2aux_engine *engine, struct timeval *tv);
+extern int pk2aux_engine_reserve(struct pk2aux_engine *engine, unsigned char **buffer);
+extern int pk2aux_engine_submit(struct pk2aux_engine *engine, size_t length);
+extern int pk2aux_engine_write(struct pk2aux_engine *engine, const void *data, size_t length);
+extern int pk2aux_reserve(pk2aux_handle handle, size_t length, unsigned char **buffer);
+extern int pk2aux_submit_reserved(pk2aux_handle handle, size_t length);
 extern int pk2aux_write(pk2aux_handle handle, const void *data, size_t length);
-extern int pk2aux_read_usb(libusb_device_handle *handle, void *data);
+extern int pk2aux_engine_read(struct pk2aux_engine *engine, void *data);
 extern int pk2aux_read(pk2aux_handle handle, void *data);
+extern int pk2aux_read_pending(pk2aux_handle handle);
+extern void pk2aux_drop_collected(pk2aux_handle handle);
+extern int pk2aux_submit_pending(pk2aux_handle handle, enum PK2AUX_REQUEST request, const void *command, size_t length, pk2aux_ticket *ticket);
+extern void pk2aux_uart_arrived(pk2aux_handle handle, const unsigned char *answer);
+extern void pk2aux_stats_write(pk2aux_handle handle, const void *data, size_t length, int rc, unsigned long retries);
+extern void pk2aux_stats_read(pk2aux_handle handle, long long submitted, int rc, unsigned long retries);
+extern int pk2aux_refresh_pg_shadow(pk2aux_handle handle);
+extern void pk2aux_decode_pg_shadow(pk2aux_handle handle, const unsigned char *state);
+extern void pk2aux_decode_voltages(const unsigned char *buffer, double *vdd, double *vpp);
 
 #endif
 
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cmd.h"
+#include "internal.h"
+#include <string.h>
+
+
+
+static int submit(pk2aux_handle handle, enum PK2AUX_REQUEST request, pk2aux_ticket *ticket) {
+	static const unsigned char VERSION_COMMAND[] = { FIRMWARE_VERSION };
+	static const unsigned char VOLTAGES_COMMAND[] = { READ_VOLTAGES };
+	static const unsigned char LEVELS_COMMAND[] = { EXECUTE_SCRIPT, 2, ICSP_STATES_BUFFER, AUX_STATE_BUFFER, UPLOAD_DATA };
+
+	handle->api = PK2AUX_API_SUBMIT;
+
+	switch (request) {
+		case PK2AUX_REQUEST_VERSION:
+			return pk2aux_submit_pending(handle, request, VERSION_COMMAND, sizeof(VERSION_COMMAND), ticket);
+
+		case PK2AUX_REQUEST_VOLTAGES:
+			return pk2aux_submit_pending(handle, request, VOLTAGES_COMMAND, sizeof(VOLTAGES_COMMAND), ticket);
+
+		case PK2AUX_REQUEST_LEVELS:
+			return pk2aux_submit_pending(handle, request, LEVELS_COMMAND, sizeof(LEVELS_COMMAND), ticket);
+
+		default:
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+}
+
+
+
+int pk2aux_submit(pk2aux_handle handle, enum PK2AUX_REQUEST request, pk2aux_ticket *ticket) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = submit(handle, request, ticket);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static struct pk2aux_pending *find_pending(pk2aux_handle handle, pk2aux_ticket ticket) {
+	struct pk2aux_pending *entry;
+
+	/* Tickets only ever go up, so anything outside the ring is long gone or never issued. */
+	if (ticket - handle->pending_first >= handle->pending_count) {
+		return 0;
+	}
+
+	/* UART data in the ring was never handed out as a ticket. */
+	entry = &handle->pending[ticket % PK2AUX_MAX_PENDING];
+	return entry->collected || entry->uart ? 0 : entry;
+}
+
+
+
+static void decode_reply(const struct pk2aux_pending *entry, pk2aux_reply *reply) {
+	const unsigned char *response = entry->response;
+
+	memset(reply, 0, sizeof(*reply));
+	reply->request = entry->request;
+
+	switch (entry->request) {
+		case PK2AUX_REQUEST_VERSION:
+			reply->major = response[0];
+			reply->minor = response[1];
+			reply->micro = response[2];
+			break;
+
+		case PK2AUX_REQUEST_VOLTAGES:
+			pk2aux_decode_voltages(response, &reply->vdd_level, &reply->vpp_level);
+			break;
+
+		case PK2AUX_REQUEST_LEVELS:
+			/* The upload buffer holds the ICSP states byte and the AUX state byte. */
+			reply->pgc_level = (response[1] & 0x01) ? 1 : 0;
+			reply->pgd_level = (response[1] & 0x02) ? 1 : 0;
+			reply->aux_level = (response[2] & 0x01) ? 1 : 0;
+			break;
+	}
+}
+
+
+
+static int collect(pk2aux_handle handle, pk2aux_ticket ticket, pk2aux_reply *reply) {
+	struct pk2aux_pending *entry;
+	int rc;
+
+	handle->api = PK2AUX_API_COLLECT;
+
+	if (!(entry = find_pending(handle, ticket))) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	/* Read answers, keeping those for earlier queries, until this one's is in. */
+	while (ticket - handle->pending_first >= handle->pending_arrived) {
+		if ((rc = pk2aux_read_pending(handle)) < 0) {
+			break;
+		}
+	}
+
+	if (entry->status == 0) {
+		decode_reply(entry, reply);
+	}
+	rc = entry->status;
+
+	entry->collected = 1;
+	pk2aux_drop_collected(handle);
+
+	return rc;
+}
+
+
+
+int pk2aux_collect(pk2aux_handle handle, pk2aux_ticket ticket, pk2aux_reply *reply) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = collect(handle, ticket, reply);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+int pk2aux_reply_ready(pk2aux_handle handle, pk2aux_ticket ticket) {
+	int ready;
+
+	pthread_mutex_lock(&handle->lock);
+
+	/* Take in whatever answers have already arrived, without waiting for more. */
+	if (!find_pending(handle, ticket)) {
+		ready = 1;
+	} else {
+		while (ticket - handle->pending_first >= handle->pending_arrived && pk2aux_engine_ready(&handle->engine)) {
+			if (pk2aux_read_pending(handle) < 0) {
+				break;
+			}
+		}
+		ready = ticket - handle->pending_first < handle->pending_arrived;
+	}
+
+	pthread_mutex_unlock(&handle->lock);
+	return ready;
+}
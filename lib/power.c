@@ -23,6 +23,18 @@
 
 
 
+void pk2aux_decode_voltages(const unsigned char *buffer, double *vdd, double *vpp) {
+	if (vdd) {
+		*vdd = (buffer[0] + buffer[1] * 256) * 5.0 / 65536.0;
+	}
+
+	if (vpp) {
+		*vpp = (buffer[2] + buffer[3] * 256) * 13.7 / 65536.0;
+	}
+}
+
+
+
 static int get_voltages(pk2aux_handle handle, double *vdd, double *vpp) {
 	int rc;
 	unsigned char buffer[64];
@@ -34,22 +46,18 @@ static int get_voltages(pk2aux_handle handle, double *vdd, double *vpp) {
 	if ((rc = pk2aux_read(handle, buffer)) < 0)
 		return rc;
 
-	if (vdd) {
-		*vdd = (buffer[0] + buffer[1] * 256) * 5.0 / 65536.0;
-	}
-
-	if (vpp) {
-		*vpp = (buffer[2] + buffer[3] * 256) * 13.7 / 65536.0;
-	}
-
+	pk2aux_decode_voltages(buffer, vdd, vpp);
 	return 0;
 }
 
 
 
-int pk2aux_set_vdd_mode(pk2aux_handle handle, enum PIN_MODE mode) {
+static int set_vdd_mode(pk2aux_handle handle, enum PIN_MODE mode) {
+	int rc;
 	unsigned char buffer[4];
 
+	handle->api = PK2AUX_API_SET_VDD_MODE;
+
 	/* Need to execute a script in order to set the VDD mode. */
 	buffer[0] = EXECUTE_SCRIPT;
 	buffer[1] = 2;
@@ -76,16 +84,36 @@ int pk2aux_set_vdd_mode(pk2aux_handle handle, enum PIN_MODE mode) {
 			return LIBUSB_ERROR_INVALID_PARAM;
 	}
 
-	return pk2aux_write(handle, buffer, 4);
+	if ((rc = pk2aux_write(handle, buffer, 4)) < 0) {
+		return rc;
+	}
+
+	handle->shadow.vdd_mode = mode;
+	handle->shadow.known |= PK2AUX_PIN_VDD;
+	return 0;
 }
 
 
 
-int pk2aux_set_vdd_level(pk2aux_handle handle, double voltage) {
+int pk2aux_set_vdd_mode(pk2aux_handle handle, enum PIN_MODE mode) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_vdd_mode(handle, mode);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int set_vdd_level(pk2aux_handle handle, double voltage) {
+	int rc;
 	unsigned char buffer[4];
 	unsigned int ccpr;
 	unsigned int fault;
 
+	handle->api = PK2AUX_API_SET_VDD_LEVEL;
+
 	/* Check for a sensible voltage level. */
 	if (voltage < 0.0 || voltage > 5.0) {
 		return LIBUSB_ERROR_INVALID_PARAM;
@@ -105,20 +133,51 @@ int pk2aux_set_vdd_level(pk2aux_handle handle, double voltage) {
 	buffer[2] = (unsigned char) (ccpr >> 8);
 	buffer[3] = (unsigned char) fault;
 
-	return pk2aux_write(handle, buffer, 4);
+	if ((rc = pk2aux_write(handle, buffer, 4)) < 0) {
+		return rc;
+	}
+
+	return 0;
+}
+
+
+
+int pk2aux_set_vdd_level(pk2aux_handle handle, double voltage) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_vdd_level(handle, voltage);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
 }
 
 
 
-int pk2aux_get_vdd_level(pk2aux_handle handle, double *voltage) {
+static int get_vdd_level(pk2aux_handle handle, double *voltage) {
+	handle->api = PK2AUX_API_GET_VDD_LEVEL;
+
 	return get_voltages(handle, voltage, 0);
 }
 
 
 
-int pk2aux_set_vpp_mode(pk2aux_handle handle, enum PIN_MODE mode) {
+int pk2aux_get_vdd_level(pk2aux_handle handle, double *voltage) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = get_vdd_level(handle, voltage);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int set_vpp_mode(pk2aux_handle handle, enum PIN_MODE mode) {
+	int rc;
 	unsigned char buffer[4];
 
+	handle->api = PK2AUX_API_SET_VPP_MODE;
+
 	/* Need to execute a script in order to set the VPP mode. */
 	buffer[0] = EXECUTE_SCRIPT;
 	buffer[1] = 2;
@@ -145,16 +204,36 @@ int pk2aux_set_vpp_mode(pk2aux_handle handle, enum PIN_MODE mode) {
 			return LIBUSB_ERROR_INVALID_PARAM;
 	}
 
-	return pk2aux_write(handle, buffer, 4);
+	if ((rc = pk2aux_write(handle, buffer, 4)) < 0) {
+		return rc;
+	}
+
+	handle->shadow.vpp_mode = mode;
+	handle->shadow.known |= PK2AUX_PIN_VPP;
+	return 0;
 }
 
 
 
-int pk2aux_set_vpp_level(pk2aux_handle handle, double voltage) {
+int pk2aux_set_vpp_mode(pk2aux_handle handle, enum PIN_MODE mode) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_vpp_mode(handle, mode);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int set_vpp_level(pk2aux_handle handle, double voltage) {
+	int rc;
 	unsigned int adc;
 	unsigned int fault;
 	unsigned char buffer[7];
 
+	handle->api = PK2AUX_API_SET_VPP_LEVEL;
+
 	/* Check for a sensible voltage level. */
 	if (voltage < 0.0 || voltage > 13.7) {
 		return LIBUSB_ERROR_INVALID_PARAM;
@@ -177,25 +256,70 @@ int pk2aux_set_vpp_level(pk2aux_handle handle, double voltage) {
 	buffer[5] = (unsigned char) adc;
 	buffer[6] = (unsigned char) fault;
 
-	return pk2aux_write(handle, buffer, 7);
+	if ((rc = pk2aux_write(handle, buffer, 7)) < 0) {
+		return rc;
+	}
+
+	return 0;
 }
 
 
 
-int pk2aux_stop_vpp_pump(pk2aux_handle handle) {
+int pk2aux_set_vpp_level(pk2aux_handle handle, double voltage) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_vpp_level(handle, voltage);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int stop_vpp_pump(pk2aux_handle handle) {
+	int rc;
 	unsigned char buffer[3];
 
+	handle->api = PK2AUX_API_STOP_VPP_PUMP;
+
 	/* This must be done as a script. */
 	buffer[0] = EXECUTE_SCRIPT;
 	buffer[1] = 1;
 	buffer[2] = VPP_PWM_OFF;
+	if ((rc = pk2aux_write(handle, buffer, 3)) < 0) {
+		return rc;
+	}
 
-	return pk2aux_write(handle, buffer, 3);
+	return 0;
 }
 
 
 
-int pk2aux_get_vpp_level(pk2aux_handle handle, double *voltage) {
+int pk2aux_stop_vpp_pump(pk2aux_handle handle) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = stop_vpp_pump(handle);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int get_vpp_level(pk2aux_handle handle, double *voltage) {
+	handle->api = PK2AUX_API_GET_VPP_LEVEL;
+
 	return get_voltages(handle, 0, voltage);
 }
 
+
+
+int pk2aux_get_vpp_level(pk2aux_handle handle, double *voltage) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = get_vpp_level(handle, voltage);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
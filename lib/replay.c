@@ -0,0 +1,400 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cmd.h"
+#include "internal.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+
+/* Replays a packet trace in place of USB. The records of each device in the trace, as
+ * identified by bus number and address, are handed out in their original order: an OUT
+ * packet written must match the next recorded one exactly, and a read returns the next
+ * recorded IN packet and status once as much time has passed since the previous record
+ * as passed when it was recorded, scaled by PK2AUX_REPLAY_SPEED. Anything that strays
+ * from the trace fails with LIBUSB_ERROR_IO, and a device whose records have run out
+ * reports LIBUSB_ERROR_NO_DEVICE. All times are in nanoseconds on CLOCK_MONOTONIC. */
+
+struct replay_record {
+	long long time;
+	unsigned int type;
+	int status;
+	unsigned char data[64];
+};
+
+struct pk2aux_replay {
+	uint8_t bus_number, device_address;
+	struct replay_record *records;
+	unsigned int num_records, next;
+	int claimed;
+
+	/* How much faster than recorded to replay, or zero to not wait at all. */
+	double speed;
+
+	/* The recorded and real times of the last record consumed. */
+	long long anchor_trace, anchor_real;
+
+	/* Where the program builds the packet it is about to send. */
+	unsigned char packet[64];
+};
+
+
+
+static long long now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+
+
+static void sleep_until(long long when) {
+	struct timespec ts;
+
+	ts.tv_sec = when / 1000000000LL;
+	ts.tv_nsec = when % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+
+
+
+static unsigned long long get_le(const unsigned char *p, unsigned int bytes) {
+	unsigned long long value = 0;
+
+	while (bytes--) {
+		value = (value << 8) | p[bytes];
+	}
+	return value;
+}
+
+
+
+static struct pk2aux_replay *find_replay(struct pk2aux_replay **replays, unsigned int *count, uint8_t bus_number, uint8_t device_address) {
+	struct pk2aux_replay *tmp;
+	unsigned int i;
+
+	for (i = 0; i < *count; ++i) {
+		if ((*replays)[i].bus_number == bus_number && (*replays)[i].device_address == device_address) {
+			return &(*replays)[i];
+		}
+	}
+
+	tmp = realloc(*replays, (*count + 1) * sizeof(*tmp));
+	if (!tmp) {
+		return 0;
+	}
+	*replays = tmp;
+
+	memset(&tmp[*count], 0, sizeof(*tmp));
+	tmp[*count].bus_number = bus_number;
+	tmp[*count].device_address = device_address;
+	return &tmp[(*count)++];
+}
+
+
+
+static int add_record(struct pk2aux_replay *replay, const unsigned char *raw) {
+	struct replay_record *tmp, *record;
+
+	/* Grow the record array in powers of two. */
+	if ((replay->num_records & (replay->num_records - 1)) == 0) {
+		tmp = realloc(replay->records, (replay->num_records ? replay->num_records * 2 : 1) * sizeof(*tmp));
+		if (!tmp) {
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		replay->records = tmp;
+	}
+
+	record = &replay->records[replay->num_records++];
+	record->time = (long long) get_le(raw, 8);
+	record->type = raw[8];
+	record->status = (int) (unsigned int) get_le(raw + 12, 4);
+	memcpy(record->data, raw + 16, 64);
+	return 0;
+}
+
+
+
+int pk2aux_replay_load(const char *path, struct pk2aux_replay **replays, unsigned int *count) {
+	unsigned char raw[PK2AUX_TRACE_RECORD_SIZE];
+	struct pk2aux_replay *replay;
+	const char *env;
+	double speed;
+	unsigned int i;
+	FILE *fp;
+	int rc = 0;
+
+	*replays = 0;
+	*count = 0;
+
+	env = getenv("PK2AUX_REPLAY_SPEED");
+	speed = env ? strtod(env, 0) : 1.0;
+	if (!(speed >= 0.0)) {
+		speed = 1.0;
+	}
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		return LIBUSB_ERROR_NOT_FOUND;
+	}
+
+	if (fread(raw, 12, 1, fp) != 1 || memcmp(raw, "PK2TRACE", 8) != 0 || get_le(raw + 8, 4) != 1) {
+		fclose(fp);
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	/* A truncated last record is what a crash leaves behind; drop it quietly. */
+	while (rc == 0 && fread(raw, sizeof(raw), 1, fp) == 1) {
+		replay = find_replay(replays, count, raw[9], raw[10]);
+		rc = replay ? add_record(replay, raw) : LIBUSB_ERROR_NO_MEM;
+	}
+	fclose(fp);
+
+	if (rc < 0) {
+		pk2aux_replay_free(*replays, *count);
+		*replays = 0;
+		*count = 0;
+		return rc;
+	}
+
+	for (i = 0; i < *count; ++i) {
+		(*replays)[i].speed = speed;
+	}
+	return 0;
+}
+
+
+
+struct pk2aux_replay *pk2aux_replay_device(struct pk2aux_replay *replays, unsigned int index, pk2aux_device *device, unsigned int *probed) {
+	struct pk2aux_replay *replay = &replays[index];
+	unsigned int i;
+
+	device->bus_number = replay->bus_number;
+	device->device_address = replay->device_address;
+	memset(device->unit_id, 0, 16);
+	*probed = 0;
+
+	/* The first OPEN record says whether the device had been probed before it was first
+	 * opened, and what its unit ID was known to be. */
+	for (i = 0; i < replay->num_records; ++i) {
+		if (replay->records[i].type == PK2AUX_TRACE_OPEN) {
+			memcpy(device->unit_id, replay->records[i].data + 1, 16);
+			*probed = replay->records[i].data[0];
+			break;
+		}
+	}
+
+	return replay;
+}
+
+
+
+void pk2aux_replay_free(struct pk2aux_replay *replays, unsigned int count) {
+	unsigned int i;
+
+	for (i = 0; i < count; ++i) {
+		free(replays[i].records);
+	}
+	free(replays);
+}
+
+
+
+static const struct replay_record *peek(struct pk2aux_replay *replay, unsigned int type) {
+	const struct replay_record *record;
+
+	if (replay->next == replay->num_records) {
+		return 0;
+	}
+	record = &replay->records[replay->next];
+	return record->type == type ? record : 0;
+}
+
+
+
+static void consume(struct pk2aux_replay *replay, long long real) {
+	replay->anchor_trace = replay->records[replay->next++].time;
+	replay->anchor_real = real;
+}
+
+
+
+static int diverged(const struct pk2aux_replay *replay) {
+	return replay->next == replay->num_records ? LIBUSB_ERROR_NO_DEVICE : LIBUSB_ERROR_IO;
+}
+
+
+
+static int replay_open(struct pk2aux_device_private *device, struct pk2aux_engine *engine) {
+	struct pk2aux_replay *replay = device->replay;
+	const struct replay_record *record;
+
+	if (replay->claimed) {
+		return LIBUSB_ERROR_BUSY;
+	}
+	if (!(record = peek(replay, PK2AUX_TRACE_OPEN))) {
+		return diverged(replay);
+	}
+
+	consume(replay, now_ns());
+	if (record->status < 0) {
+		return record->status;
+	}
+
+	replay->claimed = 1;
+	engine->replay = replay;
+	return 0;
+}
+
+
+
+static void replay_close(struct pk2aux_engine *engine, int reset) {
+	struct pk2aux_replay *replay = engine->replay;
+
+	(void) reset;
+
+	if (peek(replay, PK2AUX_TRACE_CLOSE)) {
+		consume(replay, now_ns());
+	}
+	replay->claimed = 0;
+}
+
+
+
+static int replay_nothing(struct pk2aux_engine *engine) {
+	(void) engine;
+	return 0;
+}
+
+
+
+static void replay_stop(struct pk2aux_engine *engine) {
+	(void) engine;
+}
+
+
+
+static int is_empty(const unsigned char *packet) {
+	size_t i;
+
+	for (i = 0; i < 64; ++i) {
+		if (packet[i] != END_OF_BUFFER) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+
+
+static int replay_reserve(struct pk2aux_engine *engine, unsigned char **buffer) {
+	struct pk2aux_replay *replay = engine->replay;
+	const struct replay_record *record;
+
+	/* A failure to get hold of a packet was recorded as an empty packet. */
+	record = peek(replay, PK2AUX_TRACE_OUT);
+	if (record && record->status < 0 && is_empty(record->data)) {
+		consume(replay, now_ns());
+		return record->status;
+	}
+
+	*buffer = replay->packet;
+	return 0;
+}
+
+
+
+static int replay_submit(struct pk2aux_engine *engine, size_t length) {
+	struct pk2aux_replay *replay = engine->replay;
+	const struct replay_record *record;
+
+	memset(replay->packet + length, END_OF_BUFFER, sizeof(replay->packet) - length);
+
+	/* Writes are never held back; the program sets their pace. */
+	record = peek(replay, PK2AUX_TRACE_OUT);
+	if (!record || memcmp(record->data, replay->packet, sizeof(replay->packet)) != 0) {
+		return diverged(replay);
+	}
+
+	consume(replay, now_ns());
+	return record->status;
+}
+
+
+
+static int replay_read(struct pk2aux_engine *engine, void *data) {
+	struct pk2aux_replay *replay = engine->replay;
+	const struct replay_record *record;
+	long long when, deadline;
+
+	if (!(record = peek(replay, PK2AUX_TRACE_IN))) {
+		return diverged(replay);
+	}
+
+	/* Hand the response over no sooner than it arrived when recorded, relative to the
+	 * last thing that happened, unless the deadline comes first. */
+	if (replay->speed > 0.0) {
+		when = replay->anchor_real + (long long) ((record->time - replay->anchor_trace) / replay->speed);
+		if (engine->has_deadline) {
+			deadline = engine->deadline.tv_sec * 1000000000LL + engine->deadline.tv_nsec;
+			if (when > deadline) {
+				sleep_until(deadline);
+				return LIBUSB_ERROR_TIMEOUT;
+			}
+		}
+		sleep_until(when);
+	}
+
+	consume(replay, now_ns());
+	if (record->status >= 0) {
+		memcpy(data, record->data, 64);
+	}
+	return record->status;
+}
+
+
+
+static int replay_ready(struct pk2aux_engine *engine) {
+	struct pk2aux_replay *replay = engine->replay;
+	const struct replay_record *record;
+
+	/* A read that is going to fail straight away is as ready as it will ever be. */
+	if (!(record = peek(replay, PK2AUX_TRACE_IN)) || replay->speed == 0.0) {
+		return 1;
+	}
+	return now_ns() >= replay->anchor_real + (long long) ((record->time - replay->anchor_trace) / replay->speed);
+}
+
+
+
+const struct pk2aux_transport pk2aux_replay_transport = {
+	&replay_open,
+	&replay_close,
+	&replay_nothing,
+	&replay_stop,
+	&replay_reserve,
+	&replay_submit,
+	&replay_read,
+	&replay_nothing,
+	&replay_ready
+};
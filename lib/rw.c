@@ -19,12 +19,134 @@
 #include "cmd.h"
 #include "internal.h"
 #include <string.h>
+#include <time.h>
 
 
 
-int pk2aux_write_usb(libusb_device_handle *handle, const void *data, size_t length) {
-	unsigned char buffer[64];
-	int transferred;
+static long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+
+int pk2aux_engine_time_left(const struct pk2aux_engine *engine, struct timeval *tv) {
+	struct timespec now;
+	long long ns;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ns = (engine->deadline.tv_sec - now.tv_sec) * 1000000000LL + (engine->deadline.tv_nsec - now.tv_nsec);
+	if (ns <= 0) {
+		return 0;
+	}
+
+	tv->tv_sec = ns / 1000000000LL;
+	tv->tv_usec = (ns % 1000000000LL + 999) / 1000;
+	return 1;
+}
+
+
+
+int pk2aux_engine_open(pk2aux_device *device, struct pk2aux_engine *engine) {
+	struct pk2aux_device_private *priv = device->private_data;
+	unsigned char info[17];
+	int rc;
+
+	memset(engine, 0, sizeof(*engine));
+	engine->transport = priv->transport;
+	engine->timeout = PK2AUX_TRANSFER_TIMEOUT;
+	engine->bus_number = device->bus_number;
+	engine->device_address = device->device_address;
+
+	if ((rc = engine->transport->open(priv, engine)) == 0) {
+		if ((rc = engine->transport->start(engine)) < 0) {
+			engine->transport->close(engine, 0);
+		}
+	}
+
+	/* A trace notes what was known about the device when it was opened, so that a
+	 * replay can present the device the same way. */
+	info[0] = (unsigned char) priv->probed;
+	memcpy(info + 1, device->unit_id, 16);
+	pk2aux_trace_record(engine, PK2AUX_TRACE_OPEN, rc, info, sizeof(info));
+
+	return rc;
+}
+
+
+
+void pk2aux_engine_close(struct pk2aux_engine *engine, int reset) {
+	engine->transport->stop(engine);
+	engine->transport->close(engine, reset);
+	pk2aux_trace_record(engine, PK2AUX_TRACE_CLOSE, reset, 0, 0);
+}
+
+
+
+int pk2aux_engine_start(struct pk2aux_engine *engine) {
+	return engine->transport->start(engine);
+}
+
+
+
+void pk2aux_engine_stop(struct pk2aux_engine *engine) {
+	/* Outstanding writes are delivered first, so that no command is lost. */
+	engine->transport->stop(engine);
+}
+
+
+
+int pk2aux_engine_flush(struct pk2aux_engine *engine) {
+	return engine->transport->flush(engine);
+}
+
+
+
+int pk2aux_engine_ready(struct pk2aux_engine *engine) {
+	return engine->transport->ready(engine);
+}
+
+
+
+int pk2aux_engine_reserve(struct pk2aux_engine *engine, unsigned char **buffer) {
+	int rc;
+
+	/* A failure is traced as an empty packet, which no real command ever is. */
+	if ((rc = engine->transport->reserve(engine, &engine->reserved)) < 0) {
+		pk2aux_trace_record(engine, PK2AUX_TRACE_OUT, rc, 0, 0);
+		return rc;
+	}
+
+	*buffer = engine->reserved;
+	return 0;
+}
+
+
+
+int pk2aux_engine_submit(struct pk2aux_engine *engine, size_t length) {
+	int rc;
+
+	/* An empty packet is never sent, which leaves the reserved buffer free for next time. */
+	if (length == 0) {
+		return 0;
+	}
+
+	if (length > 64) {
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+
+	rc = engine->transport->submit(engine, length);
+	pk2aux_trace_record(engine, PK2AUX_TRACE_OUT, rc, engine->reserved, length);
+	return rc;
+}
+
+
+
+int pk2aux_engine_write(struct pk2aux_engine *engine, const void *data, size_t length) {
+	unsigned char *buffer;
+	int rc;
 
 	if (length == 0) {
 		return 0;
@@ -34,29 +156,275 @@ int pk2aux_write_usb(libusb_device_handle *handle, const void *data, size_t leng
 		return LIBUSB_ERROR_OVERFLOW;
 	}
 
+	if ((rc = pk2aux_engine_reserve(engine, &buffer)) < 0) {
+		return rc;
+	}
+
 	memcpy(buffer, data, length);
-	memset(buffer + length, END_OF_BUFFER, sizeof(buffer) - length);
+	return pk2aux_engine_submit(engine, length);
+}
+
+
+
+int pk2aux_engine_read(struct pk2aux_engine *engine, void *data) {
+	int rc;
+
+	rc = engine->transport->read(engine, data);
+	pk2aux_trace_record(engine, PK2AUX_TRACE_IN, rc, data, rc < 0 ? 0 : 64);
+	return rc;
+}
+
+
+
+static int flush_batch(pk2aux_handle handle) {
+	int rc;
+
+	if (!handle->batch_used) {
+		return 0;
+	}
+
+	rc = pk2aux_engine_submit(&handle->engine, handle->batch_used);
+	handle->batch_used = 0;
+	return rc;
+}
+
+
 
-	return libusb_interrupt_transfer(handle, 0x01, buffer, sizeof(buffer), &transferred, 1000);
+int pk2aux_reserve(pk2aux_handle handle, size_t length, unsigned char **buffer) {
+	unsigned long retries = handle->engine.retries;
+	int rc;
+
+	if (length > 64) {
+		return LIBUSB_ERROR_OVERFLOW;
+	}
+
+	/* Commands are encoded straight into the next OUT packet and never split across
+	 * packets, so if this one doesn't fit behind what's already been batched, send
+	 * the batch off first. */
+	if (handle->batch_used + length > 64) {
+		if ((rc = flush_batch(handle)) < 0) {
+			handle->shadow.known = 0;
+			pk2aux_stats_write(handle, 0, 0, rc, handle->engine.retries - retries);
+			return rc;
+		}
+	}
+
+	if (!handle->batch_used) {
+		if ((rc = pk2aux_engine_reserve(&handle->engine, &handle->batch_packet)) < 0) {
+			handle->shadow.known = 0;
+			pk2aux_stats_write(handle, 0, 0, rc, handle->engine.retries - retries);
+			return rc;
+		}
+	}
+
+	*buffer = handle->batch_packet + handle->batch_used;
+	return 0;
+}
+
+
+
+int pk2aux_submit_reserved(pk2aux_handle handle, size_t length) {
+	unsigned long retries = handle->engine.retries;
+	const unsigned char *command = handle->batch_packet + handle->batch_used;
+	int rc = 0;
+
+	/* Outside a batch, the command goes off on its own straight away. */
+	handle->batch_used += length;
+	if (!handle->batch_depth && (rc = flush_batch(handle)) < 0) {
+		/* Some earlier command may not have arrived, so stop trusting the shadow. */
+		handle->shadow.known = 0;
+	}
+
+	pk2aux_stats_write(handle, command, length, rc, handle->engine.retries - retries);
+	return rc;
 }
 
 
 
 int pk2aux_write(pk2aux_handle handle, const void *data, size_t length) {
-	return pk2aux_write_usb(handle->usb_handle, data, length);
+	unsigned char *buffer;
+	int rc;
+
+	if ((rc = pk2aux_reserve(handle, length, &buffer)) < 0) {
+		return rc;
+	}
+
+	memcpy(buffer, data, length);
+	return pk2aux_submit_reserved(handle, length);
 }
 
 
 
-int pk2aux_read_usb(libusb_device_handle *handle, void *data) {
-	int transferred;
+static int read_response(pk2aux_handle handle, void *data, long long submitted) {
+	unsigned long retries = handle->engine.retries;
+	int rc;
 
-	return libusb_interrupt_transfer(handle, 0x81, data, 64, &transferred, 1000);
+	/* The command whose response is wanted may still be sitting in the batch. */
+	if ((rc = flush_batch(handle)) < 0 || (rc = pk2aux_engine_read(&handle->engine, data)) < 0) {
+		handle->shadow.known = 0;
+	}
+
+	pk2aux_stats_read(handle, submitted, rc, handle->engine.retries - retries);
+	return rc;
 }
 
 
 
 int pk2aux_read(pk2aux_handle handle, void *data) {
-	return pk2aux_read_usb(handle->usb_handle, data);
+	int rc;
+
+	/* Answers to submitted queries come first, since their commands went out first. */
+	while (handle->pending_arrived < handle->pending_count) {
+		if ((rc = pk2aux_read_pending(handle)) < 0) {
+			return rc;
+		}
+	}
+
+	return read_response(handle, data, 0);
+}
+
+
+
+int pk2aux_read_pending(pk2aux_handle handle) {
+	struct pk2aux_pending *entry;
+	int rc;
+
+	entry = &handle->pending[(handle->pending_first + handle->pending_arrived) % PK2AUX_MAX_PENDING];
+	/* A query's round trip runs from when it was submitted, however long it then waited. */
+	if ((rc = read_response(handle, entry->response, entry->submitted)) < 0) {
+		/* Once a read has failed, the answers still to come can't be matched up with their
+		 * queries, so fail all of them. */
+		while (handle->pending_arrived < handle->pending_count) {
+			entry = &handle->pending[(handle->pending_first + handle->pending_arrived++) % PK2AUX_MAX_PENDING];
+			entry->status = rc;
+			if (entry->uart) {
+				entry->collected = 1;
+				pk2aux_uart_arrived(handle, 0);
+			}
+		}
+		pk2aux_drop_collected(handle);
+		return rc;
+	}
+
+	/* UART data has nobody to collect it, so it goes straight into the receive ring. */
+	entry->status = 0;
+	handle->pending_arrived++;
+	if (entry->uart) {
+		entry->collected = 1;
+		pk2aux_uart_arrived(handle, entry->response);
+		pk2aux_drop_collected(handle);
+	}
+	return 0;
+}
+
+
+
+void pk2aux_drop_collected(pk2aux_handle handle) {
+	/* Drop the collected queries from the front of the ring. */
+	while (handle->pending_count && handle->pending[handle->pending_first % PK2AUX_MAX_PENDING].collected) {
+		handle->pending_first++;
+		handle->pending_count--;
+		handle->pending_arrived--;
+	}
+}
+
+
+
+int pk2aux_submit_pending(pk2aux_handle handle, enum PK2AUX_REQUEST request, const void *command, size_t length, pk2aux_ticket *ticket) {
+	struct pk2aux_pending *entry;
+	long long submitted;
+	int rc;
+
+	if (handle->pending_count == PK2AUX_MAX_PENDING) {
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	/* The device stops taking commands once its answers back up, which a write would then
+	 * wait on forever, so only keep as many answers in flight as there are IN transfers
+	 * to receive them. Older answers are read and kept to make room. */
+	while (handle->pending_count - handle->pending_arrived >= PK2AUX_NUM_TRANSFERS) {
+		if ((rc = pk2aux_read_pending(handle)) < 0) {
+			return rc;
+		}
+	}
+
+	submitted = now_us();
+	if ((rc = pk2aux_write(handle, command, length)) < 0) {
+		return rc;
+	}
+
+	entry = &handle->pending[(handle->pending_first + handle->pending_count) % PK2AUX_MAX_PENDING];
+	entry->request = request;
+	entry->submitted = submitted;
+	entry->uart = !ticket;
+	entry->collected = 0;
+	entry->status = 0;
+	if (ticket) {
+		*ticket = handle->pending_first + handle->pending_count;
+	}
+	handle->pending_count++;
+	return 0;
+}
+
+
+
+void pk2aux_set_timeout(pk2aux_handle handle, unsigned int timeout) {
+	pthread_mutex_lock(&handle->lock);
+	handle->engine.timeout = timeout;
+	pthread_mutex_unlock(&handle->lock);
+}
+
+
+
+void pk2aux_set_deadline(pk2aux_handle handle, const struct timespec *deadline) {
+	pthread_mutex_lock(&handle->lock);
+	if (deadline) {
+		handle->engine.deadline = *deadline;
+		handle->engine.has_deadline = 1;
+	} else {
+		handle->engine.has_deadline = 0;
+	}
+	pthread_mutex_unlock(&handle->lock);
+}
+
+
+
+void pk2aux_batch_begin(pk2aux_handle handle) {
+	pthread_mutex_lock(&handle->lock);
+	handle->batch_depth++;
+	pthread_mutex_unlock(&handle->lock);
+}
+
+
+
+static int batch_commit(pk2aux_handle handle) {
+	int rc;
+
+	handle->api = PK2AUX_API_BATCH_COMMIT;
+
+	if (!handle->batch_depth) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if (--handle->batch_depth) {
+		return 0;
+	}
+
+	if ((rc = flush_batch(handle)) < 0) {
+		handle->shadow.known = 0;
+		return rc;
+	}
+
+	return 0;
 }
 
+
+
+int pk2aux_batch_commit(pk2aux_handle handle) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = batch_commit(handle);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
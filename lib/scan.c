@@ -18,8 +18,8 @@
  */
 #include "cmd.h"
 #include "internal.h"
-#include <assert.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,18 +29,74 @@
 
 static const uint16_t VID_MICROCHIP = 0x04D8;
 static const uint16_t PID_PK2 = 0x0033;
-static libusb_context *usb_context = 0;
-static pk2aux_device *devices = 0;
-static unsigned int num_devices = 0;
 
+/* A hotplug event reported by libusb, waiting for pk2aux_hotplug_poll() to apply it. */
+struct hotplug_event {
+	libusb_device *device;
+	libusb_hotplug_event event;
+};
+
+/* Everything a context owns. The lock guards the device list, and is held while one of the
+ * context's devices is being opened. It is recursive because picking the only device may
+ * open devices while it is held. Nothing that can wait for USB traffic is done under it on
+ * behalf of hotplug, since libusb events may have to be handled meanwhile.
+ *
+ * The hotplug lock guards the rest of the hotplug state and is held while changes are applied,
+ * so that they are applied one at a time and in order. The queue lock only guards the queue,
+ * which the libusb callback appends to from whichever thread is handling events.
+ *
+ * Each device has an allocation of its own, so that the pointers handed out stay put however
+ * the list changes. A device that is unplugged moves from the list onto the gone chain, and is
+ * only freed along with the context. */
+struct pk2aux_context_impl {
+	pthread_mutex_t lock;
+	unsigned int flags;
+	int cache_enabled;
+	libusb_context *usb_context;
+	pk2aux_device **devices;
+	unsigned int num_devices;
+	pk2aux_device *gone;
+	struct pk2aux_replay *replays;
+	unsigned int num_replays;
+
+	pthread_mutex_t hotplug_lock;
+	int hotplug_registered;
+	libusb_hotplug_callback_handle hotplug_handle;
+	pk2aux_hotplug_callback hotplug_callback;
+	void *hotplug_user_data;
+	pthread_mutex_t hotplug_queue_lock;
+	struct hotplug_event *hotplug_queue;
+	unsigned int hotplug_queue_used, hotplug_queue_size;
+};
+
+/* The context behind the functions that do not take one. */
+static pk2aux_context default_context = 0;
+
+/* How many contexts exist, so that tracing can stop with the last of them. */
+static pthread_mutex_t contexts_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int num_contexts = 0;
+
+
+
+/* A PICkit2 that is being probed during pk2aux_init(). Opening and closing it are done on a
+ * thread of its own, if it has one. */
+struct probe {
+	pk2aux_device device;
+	struct pk2aux_engine engine;
+	pthread_t thread;
+	int threaded;
+	int opened;
+	int keep;
+	int ok;
+	unsigned char version[3];
+	unsigned char buffer[64];
+	unsigned char pg_buffer[64];
+};
 
 
-static int examine_device(libusb_device *device) {
-	libusb_device_handle *handle = 0;
+
+static int is_pickit2(libusb_device *device) {
 	struct libusb_device_descriptor ddev;
-	unsigned char buffer[64];
-	pk2aux_device *tmp = 0;
-	int original_config, tmp_config;
 
 	/* Get device descriptor. */
 	if (libusb_get_device_descriptor(device, &ddev) < 0) {
@@ -48,417 +104,1385 @@ static int examine_device(libusb_device *device) {
 	}
 
 	/* Check vendor and product ID. */
-	if (ddev.idVendor != VID_MICROCHIP || ddev.idProduct != PID_PK2) {
-		return 0;
-	}
+	return ddev.idVendor == VID_MICROCHIP && ddev.idProduct == PID_PK2;
+}
+
+
+
+static void *probe_open(void *arg) {
+	struct probe *probe = arg;
 
 	/* Open the device. We want to probe firmware version and see if it has a unit ID. */
-	if (libusb_open(device, &handle) < 0) {
-		return 0;
+	if (pk2aux_engine_open(&probe->device, &probe->engine) == 0) {
+		probe->opened = probe->ok = 1;
 	}
 
-	/* Get the configuration index the device was originally in. */
-	if (libusb_get_configuration(handle, &original_config) < 0) {
-		libusb_close(handle);
-		return 0;
-	}
-	if (!original_config) {
-		original_config = -1;
-	}
+	return 0;
+}
 
-	/* PICkit2s have 2 configurations; the first is HID and the second is non-HID.
-	 * I suspect using the non-HID configuration may yield better results as it may
-	 * make kernel drivers less likely to grab hold of the PICkit2. */
-	if (original_config != 2) {
-		if (libusb_set_configuration(handle, 2) < 0) {
-			libusb_close(handle);
-			return 0;
+
+
+static void *probe_close(void *arg) {
+	struct probe *probe = arg;
+
+	/* A device that is being kept open only gives back its transfers. */
+	if (probe->opened) {
+		if (probe->keep) {
+			pk2aux_engine_stop(&probe->engine);
+		} else {
+			pk2aux_engine_close(&probe->engine, 0);
 		}
 	}
 
-	/* Claim the interface. */
-	if (libusb_claim_interface(handle, 0) < 0) {
-		if (original_config != 2) {
-			libusb_set_configuration(handle, original_config);
+	return 0;
+}
+
+
+
+static void run_probes(struct probe *probes, unsigned int count, void *(*step)(void *)) {
+	unsigned int i;
+
+	/* Opening and closing a device each take several control transfers, which would add up
+	 * if devices took turns, so each probe gets a thread of its own. One that can't have
+	 * one is dealt with on this thread instead. */
+	for (i = 0; i < count; ++i) {
+		probes[i].threaded = count > 1 && pthread_create(&probes[i].thread, 0, step, &probes[i]) == 0;
+		if (!probes[i].threaded) {
+			step(&probes[i]);
 		}
-		libusb_close(handle);
-		return 0;
 	}
 
-	/* Check that the configuration index hasn't changed since. */
-	if (libusb_get_configuration(handle, &tmp_config) < 0) {
-		libusb_release_interface(handle, 0);
-		libusb_close(handle);
-		return 0;
-	}
-	if (tmp_config != 2) {
-		libusb_release_interface(handle, 0);
-		libusb_close(handle);
-		return 0;
+	for (i = 0; i < count; ++i) {
+		if (probes[i].threaded) {
+			pthread_join(probes[i].thread, 0);
+		}
 	}
+}
 
-	/* First ask for firmware version. */
-	buffer[0] = FIRMWARE_VERSION;
-	if (pk2aux_write_usb(handle, buffer, 1) < 0) {
-		libusb_release_interface(handle, 0);
-		if (original_config != 2) {
-			libusb_set_configuration(handle, original_config);
+
+
+static void probe_request(struct probe *probe, const unsigned char *command, size_t length) {
+	/* Queue the command, but don't wait for its responses, so that every device's round
+	 * trip is in flight at the same time. */
+	if (probe->ok) {
+		if (pk2aux_engine_write(&probe->engine, command, length) < 0) {
+			probe->ok = 0;
 		}
-		libusb_close(handle);
-		return 0;
 	}
-	if (pk2aux_read_usb(handle, buffer) < 0) {
-		libusb_release_interface(handle, 0);
-		if (original_config != 2) {
-			libusb_set_configuration(handle, original_config);
+}
+
+
+
+static void probe_collect(struct probe *probe) {
+	if (probe->ok) {
+		if (pk2aux_engine_read(&probe->engine, probe->buffer) < 0) {
+			probe->ok = 0;
 		}
-		libusb_close(handle);
-		return 0;
 	}
+}
+
+
+
+static int version_compatible(const unsigned char *version) {
 	/* Assume that major version != 2 means an incompatible protocol, and maybe
 	 * minor version < 30 means some commands we want aren't supported.
 	 * The protocol datasheet is for version 2.30. */
-	if (buffer[0] != 2 || buffer[1] < 30) {
-		libusb_release_interface(handle, 0);
-		if (original_config != 2) {
-			libusb_set_configuration(handle, original_config);
-		}
-		libusb_close(handle);
-		return 0;
-	}
+	return version[0] == 2 && version[1] >= 30;
+}
 
-	/* Read the unit ID from the last 16 bytes of EEPROM. */
-	buffer[0] = RD_INTERNAL_EE;
-	buffer[1] = 0xF0;
-	buffer[2] = 16;
-	if (pk2aux_write_usb(handle, buffer, 3) < 0) {
-		libusb_release_interface(handle, 0);
-		if (original_config != 2) {
-			libusb_set_configuration(handle, original_config);
-		}
-		libusb_close(handle);
-		return 0;
-	}
-	if (pk2aux_read_usb(handle, buffer) < 0) {
-		libusb_release_interface(handle, 0);
-		if (original_config != 2) {
-			libusb_set_configuration(handle, original_config);
-		}
-		libusb_close(handle);
+
+
+static int lookup_cached(pk2aux_device *device, unsigned char *eeprom) {
+	struct pk2aux_device_private *priv = device->private_data;
+	unsigned char version[3];
+
+	if (!priv->cache_key[0]) {
 		return 0;
 	}
 
-	/* Release and close the device. */
-	libusb_release_interface(handle, 0);
-	if (original_config != 2) {
-		libusb_set_configuration(handle, original_config);
+	/* An entry made with firmware this library no longer accepts is as good as none. */
+	return pk2aux_cache_lookup(priv->cache_key, version, eeprom) && version_compatible(version);
+}
+
+
+
+static void fill_unit_id(pk2aux_device *device, const unsigned char *eeprom) {
+	/* The unit ID always starts with a # character if it's been programmed by the standard application. */
+	memset(device->unit_id, 0, 16);
+	if (eeprom[0] == '#') {
+		memcpy(device->unit_id, eeprom + 1, 15);
 	}
-	libusb_close(handle);
-	handle = 0;
+}
 
-	/* Allocate a new device structure to hold the new device's data. */
-	if (devices) {
-		tmp = realloc(devices, (num_devices + 1) * sizeof(pk2aux_device));
-	} else {
-		tmp = malloc((num_devices + 1) * sizeof(pk2aux_device));
+
+
+static void remember_unit_id(pk2aux_device *device, const unsigned char *version, const unsigned char *eeprom) {
+	struct pk2aux_device_private *priv = device->private_data;
+
+	if (priv->cache_key[0]) {
+		pk2aux_cache_store(priv->cache_key, version, eeprom);
 	}
-	if (!tmp) {
-		if (devices) {
-			free(devices);
-			devices = 0;
-			num_devices = 0;
-		}
+}
+
+
+
+static int new_usb_device(pk2aux_context ctx, libusb_device *usb_device, pk2aux_device *device) {
+	struct pk2aux_device_private *priv;
+
+	priv = malloc(sizeof(*priv));
+	if (!priv) {
 		return LIBUSB_ERROR_NO_MEM;
 	}
-	devices = tmp;
 
-	/* Fill out the device structure. The unit ID always starts with a # character
-	 * if it's been programmed by the standard application. */
-	memset(devices[num_devices].unit_id, 0, 16);
-	if (buffer[0] == '#') {
-		memcpy(devices[num_devices].unit_id, buffer + 1, 15);
+	priv->context = ctx;
+	priv->transport = &pk2aux_usb_transport;
+	priv->usb_context = ctx->usb_context;
+	priv->sim = 0;
+	priv->replay = 0;
+	priv->probed = 0;
+	priv->incompatible = 0;
+	priv->gone = 0;
+	priv->next = 0;
+	priv->pooled = 0;
+	if (!ctx->cache_enabled || pk2aux_cache_key(usb_device, priv->cache_key) < 0) {
+		priv->cache_key[0] = '\0';
 	}
-	devices[num_devices].bus_number = libusb_get_bus_number(device);
-	devices[num_devices].device_address = libusb_get_device_address(device);
-	devices[num_devices].private_data = device;
-	num_devices++;
 
 	/* Keep the libusb device structure in memory. */
-	libusb_ref_device(device);
+	priv->usb_device = libusb_ref_device(usb_device);
 
+	device->private_data = priv;
+	memset(device->unit_id, 0, 16);
+	device->bus_number = libusb_get_bus_number(usb_device);
+	device->device_address = libusb_get_device_address(usb_device);
 	return 0;
 }
 
 
 
-int pk2aux_init(void) {
-	int rc;
-	libusb_device **usb_devices = 0;
-	ssize_t sz, i;
+static int new_sim_device(pk2aux_context ctx, unsigned int index, pk2aux_device *device) {
+	struct pk2aux_device_private *priv;
 
-	/* Check if already initialized. */
-	if (usb_context) {
-		return LIBUSB_ERROR_BUSY;
+	priv = malloc(sizeof(*priv));
+	if (!priv) {
+		return LIBUSB_ERROR_NO_MEM;
 	}
 
-	/* Initialize libusb. */
-	if ((rc = libusb_init(&usb_context)) < 0) {
-		return rc;
+	priv->sim = pk2aux_sim_new(index);
+	if (!priv->sim) {
+		free(priv);
+		return LIBUSB_ERROR_NO_MEM;
 	}
 
-	/* Get the device list. */
-	sz = libusb_get_device_list(usb_context, &usb_devices);
-	if (sz < 0) {
-		libusb_exit(usb_context);
-		usb_context = 0;
-		return sz;
-	}
+	/* Simulated devices live on a bus of their own and are never cached. */
+	priv->context = ctx;
+	priv->transport = &pk2aux_sim_transport;
+	priv->usb_context = 0;
+	priv->usb_device = 0;
+	priv->replay = 0;
+	priv->probed = 0;
+	priv->incompatible = 0;
+	priv->gone = 0;
+	priv->next = 0;
+	priv->pooled = 0;
+	priv->cache_key[0] = '\0';
+
+	device->private_data = priv;
+	memset(device->unit_id, 0, 16);
+	device->bus_number = 0;
+	device->device_address = (uint8_t) (index + 1);
+	return 0;
+}
 
-	/* Walk the devices looking for PICkit2s. */
-	for (i = 0; i < sz; ++i) {
-		if ((rc = examine_device(usb_devices[i])) < 0) {
-			break;
-		}
-	}
 
-	/* Free the list and those devices that were not reffed by examine_device. */
-	libusb_free_device_list(usb_devices, 1);
 
-	/* If examine_device failed for some device, call pk2aux_exit() and return the error code. */
-	if (rc < 0) {
-		pk2aux_exit();
-		return rc;
-	} else {
-		return 0;
+static int new_replay_device(pk2aux_context ctx, unsigned int index, pk2aux_device *device) {
+	struct pk2aux_device_private *priv;
+
+	priv = malloc(sizeof(*priv));
+	if (!priv) {
+		return LIBUSB_ERROR_NO_MEM;
 	}
+
+	/* A replayed device comes back as it was first opened in the trace, possibly with
+	 * its unit ID already known. */
+	priv->context = ctx;
+	priv->transport = &pk2aux_replay_transport;
+	priv->usb_context = 0;
+	priv->usb_device = 0;
+	priv->sim = 0;
+	priv->replay = pk2aux_replay_device(ctx->replays, index, device, &priv->probed);
+	priv->incompatible = 0;
+	priv->gone = 0;
+	priv->next = 0;
+	priv->pooled = 0;
+	priv->cache_key[0] = '\0';
+
+	device->private_data = priv;
+	return 0;
 }
 
 
 
-void pk2aux_exit(void) {
-	unsigned int i;
+static void release_device(pk2aux_device *device) {
+	struct pk2aux_device_private *priv = device->private_data;
 
-	for (i = 0; i < num_devices; ++i) {
-		libusb_unref_device((libusb_device *) devices[i].private_data);
+	/* The pooled session is already stopped, which stopping again does no harm to. */
+	if (priv->pooled) {
+		pk2aux_engine_close(&priv->pooled_engine, 0);
+		priv->pooled = 0;
 	}
-
-	if (devices) {
-		free(devices);
-		devices = 0;
-		num_devices = 0;
+	if (priv->usb_device) {
+		libusb_unref_device(priv->usb_device);
+		priv->usb_device = 0;
 	}
-
-	if (usb_context) {
-		libusb_exit(usb_context);
-		usb_context = 0;
+	if (priv->sim) {
+		pk2aux_sim_free(priv->sim);
+		priv->sim = 0;
 	}
 }
 
 
 
-pk2aux_device_list pk2aux_get_devices(void) {
-	pk2aux_device_list dlist;
-
-	dlist.num_devices = num_devices;
-	dlist.devices = devices;
-	return dlist;
+static void free_device(pk2aux_device *device) {
+	release_device(device);
+	free(device->private_data);
 }
 
 
 
-pk2aux_device *pk2aux_find_device(const char *path) {
-	uint8_t bus_number, device_address;
-	unsigned int i;
+static int add_device(pk2aux_context ctx, pk2aux_device *device) {
+	pk2aux_device **tmp = 0, *copy;
 
-	/* Check if this is the NULL path case. */
-	if (!path) {
-		if (num_devices == 1) {
-			return &devices[0];
-		} else {
-			return 0;
-		}
+	copy = malloc(sizeof(*copy));
+	if (!copy) {
+		return LIBUSB_ERROR_NO_MEM;
 	}
+	*copy = *device;
 
-	/* Try to parse the path. */
-	if (sscanf(path, "%" SCNu8 ":%" SCNu8, &bus_number, &device_address) != 2) {
-		return 0;
+	/* Make room for the new device at the end of the list. */
+	pthread_mutex_lock(&ctx->lock);
+	if (ctx->devices) {
+		tmp = realloc(ctx->devices, (ctx->num_devices + 1) * sizeof(*ctx->devices));
+	} else {
+		tmp = malloc((ctx->num_devices + 1) * sizeof(*ctx->devices));
 	}
-
-	/* Scan for the requested device. */
-	for (i = 0; i < num_devices; i++) {
-		if (devices[i].bus_number == bus_number && devices[i].device_address == device_address) {
-			return &devices[i];
-		}
+	if (!tmp) {
+		pthread_mutex_unlock(&ctx->lock);
+		free(copy);
+		return LIBUSB_ERROR_NO_MEM;
 	}
+	ctx->devices = tmp;
 
+	ctx->devices[ctx->num_devices++] = copy;
+	pthread_mutex_unlock(&ctx->lock);
 	return 0;
 }
 
 
 
-int pk2aux_open(pk2aux_device *device, pk2aux_handle *result) {
-	pk2aux_handle handle;
-	int rc, tmp_config;
-	unsigned char buffer[64];
+static int examine_devices(pk2aux_context ctx, pk2aux_device *candidates, unsigned int count) {
+	static const unsigned char VERSION_COMMAND[] = { FIRMWARE_VERSION };
+	/* Read the unit ID from the last 16 bytes of EEPROM. If the device is going to be kept
+	 * open, also find out what PGC and PGD are doing as pk2aux_open() would. */
+	static const unsigned char UNIT_ID_COMMAND[] = { RD_INTERNAL_EE, 0xF0, 16, EXECUTE_SCRIPT, 3, PEEK_SFR, 0x92, ICSP_STATES_BUFFER, UPLOAD_DATA };
+	const int keep_open = (ctx->flags & PK2AUX_INIT_KEEP_OPEN) != 0;
+	struct pk2aux_device_private *priv;
+	struct probe *probes;
+	unsigned int num_probes = 0, i;
+	int rc = 0;
+	unsigned char eeprom[16];
 
-	/* Allocate space for the private data structure. */
-	handle = malloc(sizeof(*handle));
-	if (!handle) {
+	probes = calloc(count ? count : 1, sizeof(*probes));
+	if (!probes) {
+		for (i = 0; i < count; ++i) {
+			free_device(&candidates[i]);
+		}
 		return LIBUSB_ERROR_NO_MEM;
 	}
 
-	/* Open the PICkit2. */
-	if ((rc = libusb_open((libusb_device *) device->private_data, &handle->usb_handle)) < 0) {
-		free(handle);
-		return rc;
+	/* Probe every candidate, except those the cache already knows about. */
+	for (i = 0; i < count; ++i) {
+		priv = candidates[i].private_data;
+		if (priv->probed || lookup_cached(&candidates[i], eeprom)) {
+			if (!priv->probed) {
+				fill_unit_id(&candidates[i], eeprom);
+				priv->probed = 1;
+			}
+			if (rc == 0 && (rc = add_device(ctx, &candidates[i])) == 0) {
+				continue;
+			}
+			free_device(&candidates[i]);
+		} else {
+			probes[num_probes++].device = candidates[i];
+		}
 	}
+	run_probes(probes, num_probes, &probe_open);
 
-	/* Get its current configuration. */
-	if ((rc = libusb_get_configuration(handle->usb_handle, &handle->original_configuration)) < 0) {
-		libusb_close(handle->usb_handle);
-		free(handle);
-		return rc;
+	/* First ask all of them for their firmware versions. */
+	for (i = 0; i < num_probes; ++i) {
+		probe_request(&probes[i], VERSION_COMMAND, sizeof(VERSION_COMMAND));
 	}
-	if (handle->original_configuration == 0) {
-		handle->original_configuration = -1;
+	for (i = 0; i < num_probes; ++i) {
+		probe_collect(&probes[i]);
+		if (probes[i].ok && !version_compatible(probes[i].buffer)) {
+			probes[i].ok = 0;
+		}
+		memcpy(probes[i].version, probes[i].buffer, 3);
 	}
 
-	/* Set it to the non-HID configuration if needed. */
-	if (handle->original_configuration != 2) {
-		if ((rc = libusb_set_configuration(handle->usb_handle, 2)) < 0) {
-			libusb_close(handle->usb_handle);
-			free(handle);
-			return rc;
+	/* Then ask the compatible ones for their unit IDs. */
+	for (i = 0; i < num_probes; ++i) {
+		probe_request(&probes[i], UNIT_ID_COMMAND, keep_open ? sizeof(UNIT_ID_COMMAND) : 3);
+	}
+	for (i = 0; i < num_probes; ++i) {
+		probe_collect(&probes[i]);
+		if (keep_open && probes[i].ok) {
+			/* The PGC/PGD state comes back in a second response. */
+			if (pk2aux_engine_read(&probes[i].engine, probes[i].pg_buffer) < 0 || probes[i].pg_buffer[0] != 2) {
+				probes[i].ok = 0;
+			}
 		}
 	}
 
-	/* Claim the interface containing the two endpoints. */
-	if ((rc = libusb_claim_interface(handle->usb_handle, 0)) < 0) {
-		if (handle->original_configuration != 2) {
-			libusb_set_configuration(handle->usb_handle, handle->original_configuration);
+	/* The devices that worked are either left open for pk2aux_open() to adopt, or closed
+	 * like the rest. */
+	for (i = 0; i < num_probes; ++i) {
+		probes[i].keep = keep_open && probes[i].ok;
+	}
+	run_probes(probes, num_probes, &probe_close);
+
+	/* Keep the devices that worked. A device left open is pooled first, so that freeing
+	 * it closes the session too. */
+	for (i = 0; i < num_probes; ++i) {
+		priv = probes[i].device.private_data;
+		if (probes[i].keep) {
+			priv->pooled_engine = probes[i].engine;
+			priv->pooled = 1;
+			memcpy(priv->pooled_pg_state, probes[i].pg_buffer + 1, 2);
 		}
-		libusb_close(handle->usb_handle);
-		free(handle);
-		return rc;
+		if (probes[i].ok && rc == 0) {
+			fill_unit_id(&probes[i].device, probes[i].buffer);
+			priv->probed = 1;
+			remember_unit_id(&probes[i].device, probes[i].version, probes[i].buffer);
+			if ((rc = add_device(ctx, &probes[i].device)) == 0) {
+				continue;
+			}
+		}
+		free_device(&probes[i].device);
 	}
 
-	/* Verify that we got the proper configuration. */
-	if ((rc = libusb_get_configuration(handle->usb_handle, &tmp_config)) < 0) {
-		libusb_release_interface(handle->usb_handle, 0);
-		if (handle->original_configuration != 2) {
-			libusb_set_configuration(handle->usb_handle, handle->original_configuration);
+	free(probes);
+	return rc;
+}
+
+
+
+static int list_devices(pk2aux_context ctx, pk2aux_device *candidates, unsigned int count) {
+	unsigned int i;
+	int rc = 0;
+	unsigned char eeprom[16];
+
+	/* Take every candidate on trust; each is probed when it is opened, unless the
+	 * cache already has its details. */
+	for (i = 0; i < count; ++i) {
+		if (lookup_cached(&candidates[i], eeprom)) {
+			fill_unit_id(&candidates[i], eeprom);
+			((struct pk2aux_device_private *) candidates[i].private_data)->probed = 1;
 		}
-		libusb_close(handle->usb_handle);
-		free(handle);
+		if (rc == 0 && (rc = add_device(ctx, &candidates[i])) == 0) {
+			continue;
+		}
+		free_device(&candidates[i]);
+	}
+
+	return rc;
+}
+
+
+
+static int scan_devices(pk2aux_context ctx, pk2aux_device *candidates, unsigned int count) {
+	/* Either just list the PICkit2s or probe all of them at once. Either way, every
+	 * candidate ends up in the device list or freed. */
+	if (ctx->flags & PK2AUX_INIT_LAZY) {
+		return list_devices(ctx, candidates, count);
+	} else {
+		return examine_devices(ctx, candidates, count);
+	}
+}
+
+
+
+static int scan_usb(pk2aux_context ctx) {
+	libusb_device **usb_devices = 0;
+	pk2aux_device *candidates;
+	unsigned int count = 0, i;
+	ssize_t sz, j;
+	int rc = 0;
+
+	/* Initialize libusb. */
+	if ((rc = libusb_init(&ctx->usb_context)) < 0) {
+		ctx->usb_context = 0;
 		return rc;
 	}
-	if (tmp_config != 2) {
-		libusb_release_interface(handle->usb_handle, 0);
-		if (handle->original_configuration != 2) {
-			libusb_set_configuration(handle->usb_handle, handle->original_configuration);
+
+	/* Get the device list. */
+	sz = libusb_get_device_list(ctx->usb_context, &usb_devices);
+	if (sz < 0) {
+		return sz;
+	}
+
+	candidates = malloc((sz ? sz : 1) * sizeof(*candidates));
+	if (!candidates) {
+		libusb_free_device_list(usb_devices, 1);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* Pick out the PICkit2s. */
+	for (j = 0; j < sz && rc == 0; ++j) {
+		if (is_pickit2(usb_devices[j]) && (rc = new_usb_device(ctx, usb_devices[j], &candidates[count])) == 0) {
+			count++;
 		}
-		libusb_close(handle->usb_handle);
-		free(handle);
-		return LIBUSB_ERROR_BUSY;
 	}
 
-	/* The firmware doesn't contain any commands directly intended to probe
-	 * for the current state of the pins (i.e. whether VDD/VPP/PGC/PGD/AUX
-	 * are grounded, high, or floating). Unfortunately, the PGC and PGD pins
-	 * are tied together in such a way that the only SET command that affects
-	 * either of those pins sets the states of both pins simultaneously. This
-	 * means it is impossible to write a function to set the state of one pin
-	 * without changing the state of the other pin, in the general case. Since
-	 * this would be highly desirable functionality, the code following is a
-	 * horrible horrible hack which accomplishes just that: it uses the PEEK SFR
-	 * function to peek at the TRISA register in order to determine whether each
-	 * of PGC and PGD are currently inputs or outputs. Once this determination is
-	 * made, further queries to determine actual voltage levels can be accomplished
-	 * by means of the regular ICSP_STATES_BUFFER command. */
-	buffer[0] = EXECUTE_SCRIPT;
-	buffer[1] = 2;
-	buffer[2] = PEEK_SFR;
-	buffer[3] = 0x92; /* TRISA */
-	buffer[4] = UPLOAD_DATA;
-	if ((rc = pk2aux_write(handle, buffer, 5)) < 0) {
-		libusb_release_interface(handle->usb_handle, 0);
-		if (handle->original_configuration != 2) {
-			libusb_set_configuration(handle->usb_handle, handle->original_configuration);
+	if (rc == 0) {
+		rc = scan_devices(ctx, candidates, count);
+	} else {
+		for (i = 0; i < count; ++i) {
+			free_device(&candidates[i]);
 		}
-		libusb_close(handle->usb_handle);
-		free(handle);
-		return rc;
 	}
 
-	if ((rc = pk2aux_read(handle, buffer)) < 0) {
-		libusb_release_interface(handle->usb_handle, 0);
-		if (handle->original_configuration != 2) {
-			libusb_set_configuration(handle->usb_handle, handle->original_configuration);
+	/* Every PICkit2 on the system has now been looked up in the cache, so whatever was not
+	 * belongs to a device that is no longer there. */
+	if (rc == 0 && ctx->cache_enabled) {
+		pk2aux_cache_prune();
+	}
+
+	/* Free the list and those devices that were not reffed by new_usb_device. */
+	libusb_free_device_list(usb_devices, 1);
+	free(candidates);
+	return rc;
+}
+
+
+
+static int scan_simulated(pk2aux_context ctx, unsigned int count) {
+	pk2aux_device *candidates;
+	unsigned int made = 0, i;
+	int rc = 0;
+
+	candidates = malloc(count * sizeof(*candidates));
+	if (!candidates) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	while (made < count && (rc = new_sim_device(ctx, made, &candidates[made])) == 0) {
+		made++;
+	}
+
+	if (rc == 0) {
+		rc = scan_devices(ctx, candidates, count);
+	} else {
+		for (i = 0; i < made; ++i) {
+			free_device(&candidates[i]);
 		}
-		libusb_close(handle->usb_handle);
-		free(handle);
+	}
+
+	free(candidates);
+	return rc;
+}
+
+
+
+static int scan_replay(pk2aux_context ctx, const char *path) {
+	pk2aux_device *candidates;
+	unsigned int count, made = 0, i;
+	int rc;
+
+	if ((rc = pk2aux_replay_load(path, &ctx->replays, &count)) < 0) {
 		return rc;
 	}
+	ctx->num_replays = count;
 
-	assert(buffer[0] == 1);
-	handle->pgc_floating = (buffer[buffer[0]] & 0x08) ? 1 : 0; /* PGC is RA3 */
-	handle->pgd_floating = (buffer[buffer[0]] & 0x04) ? 1 : 0; /* PGD is RA2 */
+	candidates = malloc((count ? count : 1) * sizeof(*candidates));
+	if (!candidates) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
 
-	handle->uart_enabled = 0;
+	while (made < count && (rc = new_replay_device(ctx, made, &candidates[made])) == 0) {
+		made++;
+	}
 
-	*result = handle;
-	return 0;
+	if (rc == 0) {
+		rc = scan_devices(ctx, candidates, count);
+	} else {
+		for (i = 0; i < made; ++i) {
+			free_device(&candidates[i]);
+		}
+	}
+
+	free(candidates);
+	return rc;
 }
 
 
 
-void pk2aux_reset(pk2aux_handle handle) {
-	unsigned char buffer[1];
+static unsigned int simulated_devices(unsigned int flags) {
+	const char *env = getenv("PK2AUX_SIM");
+	unsigned long count = 0;
 
-	if (handle->uart_enabled) {
-		pk2aux_stop_uart(handle);
+	/* The environment can switch a program over to the simulator without its knowledge. */
+	if (env) {
+		count = strtoul(env, 0, 10);
+	}
+	if (!count && (flags & PK2AUX_INIT_SIMULATED)) {
+		count = 1;
 	}
 
-	buffer[0] = RESET;
-	pk2aux_write(handle, buffer, 1);
-	libusb_reset_device(handle->usb_handle);
-	libusb_close(handle->usb_handle);
-	free(handle);
+	return count > 127 ? 127 : (unsigned int) count;
 }
 
 
 
-void pk2aux_close(pk2aux_handle handle) {
-	if (handle->uart_enabled) {
-		pk2aux_stop_uart(handle);
-	}
+static void init_recursive_mutex(pthread_mutex_t *mutex) {
+	pthread_mutexattr_t attr;
 
-	libusb_release_interface(handle->usb_handle, 0);
-	if (handle->original_configuration != 2) {
-		libusb_set_configuration(handle->usb_handle, handle->original_configuration);
-	}
-	libusb_close(handle->usb_handle);
-	free(handle);
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(mutex, &attr);
+	pthread_mutexattr_destroy(&attr);
 }
 
 
 
-int pk2aux_get_version(pk2aux_handle handle, unsigned int *major, unsigned int *minor, unsigned int *micro) {
-	unsigned char buffer[64];
+static void init_monotonic_cond(pthread_cond_t *cond) {
+	pthread_condattr_t attr;
+
+	/* Timed waits are measured on the same clock as everything else. */
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(cond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+
+
+int pk2aux_context_new(pk2aux_context *result, unsigned int flags) {
+	const char *replay, *trace, *cache;
+	pk2aux_context ctx;
+	unsigned int simulated;
 	int rc;
 
-	buffer[0] = FIRMWARE_VERSION;
-	if ((rc = pk2aux_write(handle, buffer, 1)) < 0) {
-		return rc;
+	ctx = calloc(1, sizeof(*ctx));
+	if (!ctx) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	init_recursive_mutex(&ctx->lock);
+	init_recursive_mutex(&ctx->hotplug_lock);
+	pthread_mutex_init(&ctx->hotplug_queue_lock, 0);
+	ctx->flags = flags;
+
+	/* Record the traffic to and from every device if asked to. The recording is shared
+	 * by all contexts. */
+	pthread_mutex_lock(&contexts_lock);
+	if (num_contexts++ == 0) {
+		trace = getenv("PK2AUX_TRACE");
+		if (trace && *trace) {
+			pk2aux_trace_start(trace);
+		}
+	}
+	pthread_mutex_unlock(&contexts_lock);
+
+	/* Load what's known about the devices from previous runs. Naming a cache file in the
+	 * environment turns the cache on for any program. */
+	cache = getenv("PK2AUX_CACHE");
+	ctx->cache_enabled = (flags & PK2AUX_INIT_CACHE) != 0 || (cache && *cache);
+	if (ctx->cache_enabled) {
+		pk2aux_cache_load();
 	}
 
-	if ((rc = pk2aux_read(handle, buffer)) < 0) {
+	/* Find the devices, real, replayed or simulated. */
+	replay = getenv("PK2AUX_REPLAY");
+	if (replay && *replay) {
+		rc = scan_replay(ctx, replay);
+	} else if ((simulated = simulated_devices(flags))) {
+		rc = scan_simulated(ctx, simulated);
+	} else {
+		rc = scan_usb(ctx);
+	}
+
+	/* Write back whatever was newly probed. */
+	pk2aux_cache_save();
+
+	/* If the scan failed, free the context again and return the error code. */
+	if (rc < 0) {
+		pk2aux_context_free(ctx);
 		return rc;
 	}
 
-	*major = buffer[0];
-	*minor = buffer[1];
-	*micro = buffer[2];
+	*result = ctx;
 	return 0;
 }
 
+
+
+void pk2aux_context_free(pk2aux_context ctx) {
+	pk2aux_device *device;
+	unsigned int i;
+
+	pk2aux_context_hotplug_stop(ctx);
+
+	for (i = 0; i < ctx->num_devices; ++i) {
+		free_device(ctx->devices[i]);
+		free(ctx->devices[i]);
+	}
+	free(ctx->devices);
+	while ((device = ctx->gone)) {
+		ctx->gone = ((struct pk2aux_device_private *) device->private_data)->next;
+		free_device(device);
+		free(device);
+	}
+
+	if (ctx->usb_context) {
+		libusb_exit(ctx->usb_context);
+	}
+
+	pk2aux_replay_free(ctx->replays, ctx->num_replays);
+
+	if (ctx->cache_enabled) {
+		pk2aux_cache_free();
+	}
+
+	pthread_mutex_lock(&contexts_lock);
+	if (--num_contexts == 0) {
+		pk2aux_trace_stop();
+	}
+	pthread_mutex_unlock(&contexts_lock);
+
+	pthread_mutex_destroy(&ctx->hotplug_queue_lock);
+	pthread_mutex_destroy(&ctx->hotplug_lock);
+	pthread_mutex_destroy(&ctx->lock);
+	free(ctx);
+}
+
+
+
+pk2aux_device_list pk2aux_context_get_devices(pk2aux_context ctx) {
+	pk2aux_device_list dlist;
+
+	/* Hand out a copy of the list, which hotplug changes cannot move or shorten. */
+	pthread_mutex_lock(&ctx->lock);
+	dlist.num_devices = 0;
+	dlist.devices = malloc((ctx->num_devices ? ctx->num_devices : 1) * sizeof(*dlist.devices));
+	if (dlist.devices) {
+		memcpy(dlist.devices, ctx->devices, ctx->num_devices * sizeof(*dlist.devices));
+		dlist.num_devices = ctx->num_devices;
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return dlist;
+}
+
+
+
+void pk2aux_free_device_list(pk2aux_device_list dlist) {
+	free(dlist.devices);
+}
+
+
+
+static pk2aux_device *only_device(pk2aux_context ctx) {
+	struct pk2aux_device_private *priv;
+	pk2aux_device *device = 0;
+	unsigned int count = 0, i;
+
+	/* When there are several devices, those not yet probed may turn out to be incompatible,
+	 * so find out before deciding that the choice is ambiguous. */
+	for (i = 0; i < ctx->num_devices; ++i) {
+		priv = ctx->devices[i]->private_data;
+		if (!priv->incompatible) {
+			count++;
+		}
+	}
+	if (count > 1) {
+		for (i = 0; i < ctx->num_devices; ++i) {
+			pk2aux_probe_device(ctx->devices[i]);
+		}
+	}
+
+	/* Devices whose firmware is known to be incompatible are not a choice at all. */
+	count = 0;
+	for (i = 0; i < ctx->num_devices; ++i) {
+		priv = ctx->devices[i]->private_data;
+		if (!priv->incompatible) {
+			device = ctx->devices[i];
+			count++;
+		}
+	}
+
+	return count == 1 ? device : 0;
+}
+
+
+
+pk2aux_device *pk2aux_context_find_device(pk2aux_context ctx, const char *path) {
+	pk2aux_device *device = 0;
+	uint8_t bus_number, device_address;
+	unsigned int i;
+
+	pthread_mutex_lock(&ctx->lock);
+
+	if (!path) {
+		/* A null path picks the only compatible device, if there is only one. */
+		device = only_device(ctx);
+	} else if (sscanf(path, "%" SCNu8 ":%" SCNu8, &bus_number, &device_address) == 2) {
+		/* Scan for the requested device. */
+		for (i = 0; i < ctx->num_devices; i++) {
+			if (ctx->devices[i]->bus_number == bus_number && ctx->devices[i]->device_address == device_address) {
+				device = ctx->devices[i];
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&ctx->lock);
+	return device;
+}
+
+
+
+int pk2aux_init(void) {
+	return pk2aux_init_ex(0);
+}
+
+
+
+int pk2aux_init_ex(unsigned int flags) {
+	/* Check if already initialized. */
+	if (default_context) {
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	return pk2aux_context_new(&default_context, flags);
+}
+
+
+
+void pk2aux_exit(void) {
+	if (default_context) {
+		pk2aux_context_free(default_context);
+		default_context = 0;
+	}
+}
+
+
+
+pk2aux_context pk2aux_get_default_context(void) {
+	return default_context;
+}
+
+
+
+pk2aux_device_list pk2aux_get_devices(void) {
+	pk2aux_device_list dlist;
+
+	if (!default_context) {
+		dlist.num_devices = 0;
+		dlist.devices = 0;
+		return dlist;
+	}
+
+	return pk2aux_context_get_devices(default_context);
+}
+
+
+
+pk2aux_device *pk2aux_find_device(const char *path) {
+	return default_context ? pk2aux_context_find_device(default_context, path) : 0;
+}
+
+
+
+static int probe_handle(pk2aux_handle handle, pk2aux_device *device) {
+	struct pk2aux_device_private *priv = device->private_data;
+	int rc;
+	unsigned char version[3];
+	unsigned char buffer[64];
+
+	/* Ask for the firmware version and the unit ID in one packet. */
+	buffer[0] = FIRMWARE_VERSION;
+	buffer[1] = RD_INTERNAL_EE;
+	buffer[2] = 0xF0;
+	buffer[3] = 16;
+	if ((rc = pk2aux_write(handle, buffer, 4)) < 0) {
+		return rc;
+	}
+
+	if ((rc = pk2aux_read(handle, buffer)) < 0) {
+		return rc;
+	}
+	if (!version_compatible(buffer)) {
+		/* Still collect the EEPROM response so nothing is left in flight. */
+		pk2aux_read(handle, buffer);
+		priv->incompatible = 1;
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	memcpy(version, buffer, 3);
+
+	if ((rc = pk2aux_read(handle, buffer)) < 0) {
+		return rc;
+	}
+	fill_unit_id(device, buffer);
+	priv->probed = 1;
+	remember_unit_id(device, version, buffer);
+	pk2aux_cache_save();
+
+	return 0;
+}
+
+
+
+static void free_handle(pk2aux_handle handle) {
+	pthread_cond_destroy(&handle->uart_pump_wake);
+	pthread_mutex_destroy(&handle->lock);
+	free(handle->uart_rx);
+	free(handle);
+}
+
+
+
+static int open_device(pk2aux_device *device, pk2aux_handle *result) {
+	struct pk2aux_device_private *priv = device->private_data;
+	pk2aux_handle handle;
+	int rc, adopted = 0;
+
+	/* There is no point talking to a device that has been unplugged, or whose firmware is
+	 * known not to be understood. */
+	if (priv->gone) {
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	if (priv->incompatible) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	/* Allocate space for the private data structure. */
+	handle = malloc(sizeof(*handle));
+	if (!handle) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	handle->uart_rx = malloc(PK2AUX_UART_RX_SIZE);
+	if (!handle->uart_rx) {
+		free(handle);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	handle->uart_rx_size = PK2AUX_UART_RX_SIZE;
+	handle->uart_rx_head = handle->uart_rx_used = 0;
+	init_recursive_mutex(&handle->lock);
+	init_monotonic_cond(&handle->uart_pump_wake);
+	handle->uart_pump_running = 0;
+
+	/* Take over the session pk2aux_init() left open, if there is one, or else open the PICkit2. */
+	if (priv->pooled) {
+		handle->engine = priv->pooled_engine;
+		priv->pooled = 0;
+		adopted = 1;
+		if ((rc = pk2aux_engine_start(&handle->engine)) < 0) {
+			pk2aux_engine_close(&handle->engine, 0);
+			free_handle(handle);
+			return rc;
+		}
+	} else if ((rc = pk2aux_engine_open(device, &handle->engine)) < 0) {
+		free_handle(handle);
+		return rc;
+	}
+
+	handle->uart_enabled = 0;
+	handle->uart_requested = 0;
+	handle->pending_first = 0;
+	handle->pending_count = 0;
+	handle->pending_arrived = 0;
+	handle->batch_depth = 0;
+	handle->batch_used = 0;
+	handle->shadow.known = 0;
+	strcpy(handle->cache_key, priv->cache_key);
+	handle->bus_number = device->bus_number;
+	handle->device_address = device->device_address;
+	handle->api = PK2AUX_API_OPEN;
+	handle->expected_first = 0;
+	handle->expected_count = 0;
+	pk2aux_reset_stats(handle);
+
+	/* A lazily enumerated device has not been checked out yet. */
+	if (!priv->probed) {
+		if ((rc = probe_handle(handle, device)) < 0) {
+			pk2aux_engine_close(&handle->engine, 0);
+			free_handle(handle);
+			return rc;
+		}
+	}
+
+	/* Find out what PGC and PGD are doing, so that either can be set without disturbing the other.
+	 * An adopted session already asked, and nothing else can have touched the pins since. */
+	if (adopted) {
+		pk2aux_decode_pg_shadow(handle, priv->pooled_pg_state);
+	} else if ((rc = pk2aux_refresh_pg_shadow(handle)) < 0) {
+		pk2aux_engine_close(&handle->engine, 0);
+		free_handle(handle);
+		return rc;
+	}
+
+	*result = handle;
+	return 0;
+}
+
+
+
+int pk2aux_open(pk2aux_device *device, pk2aux_handle *result) {
+	pk2aux_context ctx = ((struct pk2aux_device_private *) device->private_data)->context;
+	int rc;
+
+	/* Opening is serialized per context, since it may adopt or probe the device. */
+	pthread_mutex_lock(&ctx->lock);
+	rc = open_device(device, result);
+	pthread_mutex_unlock(&ctx->lock);
+	return rc;
+}
+
+
+
+int pk2aux_probe_device(pk2aux_device *device) {
+	struct pk2aux_device_private *priv = device->private_data;
+	pk2aux_handle handle;
+	int rc = 0;
+
+	/* Opening the device probes it. The context lock is held from the check on, as opening
+	 * holds it, so that another thread probing or opening the device can't come in between. */
+	pthread_mutex_lock(&priv->context->lock);
+	if (!priv->probed && (rc = open_device(device, &handle)) == 0) {
+		pk2aux_close(handle);
+	}
+	pthread_mutex_unlock(&priv->context->lock);
+	return rc;
+}
+
+
+
+void pk2aux_reset(pk2aux_handle handle) {
+	unsigned char buffer[1];
+
+	pk2aux_stop_uart_pump(handle);
+
+	pthread_mutex_lock(&handle->lock);
+	handle->api = PK2AUX_API_RESET;
+
+	/* Shutting the device down is not subject to any deadline. */
+	handle->engine.has_deadline = 0;
+
+	if (handle->batch_depth) {
+		handle->batch_depth = 1;
+		pk2aux_batch_commit(handle);
+	}
+
+	if (handle->uart_enabled) {
+		pk2aux_stop_uart(handle);
+	}
+
+	buffer[0] = RESET;
+	pk2aux_write(handle, buffer, 1);
+	pk2aux_engine_close(&handle->engine, 1);
+	pthread_mutex_unlock(&handle->lock);
+	free_handle(handle);
+}
+
+
+
+void pk2aux_close(pk2aux_handle handle) {
+	pk2aux_stop_uart_pump(handle);
+
+	pthread_mutex_lock(&handle->lock);
+	handle->api = PK2AUX_API_CLOSE;
+
+	/* Shutting the device down is not subject to any deadline. */
+	handle->engine.has_deadline = 0;
+
+	if (handle->batch_depth) {
+		handle->batch_depth = 1;
+		pk2aux_batch_commit(handle);
+	}
+
+	if (handle->uart_enabled) {
+		pk2aux_stop_uart(handle);
+	}
+
+	pk2aux_engine_close(&handle->engine, 0);
+	pthread_mutex_unlock(&handle->lock);
+	free_handle(handle);
+}
+
+
+
+static int get_version(pk2aux_handle handle, unsigned int *major, unsigned int *minor, unsigned int *micro) {
+	unsigned char buffer[64];
+	int rc;
+
+	handle->api = PK2AUX_API_GET_VERSION;
+
+	buffer[0] = FIRMWARE_VERSION;
+	if ((rc = pk2aux_write(handle, buffer, 1)) < 0) {
+		return rc;
+	}
+
+	if ((rc = pk2aux_read(handle, buffer)) < 0) {
+		return rc;
+	}
+
+	*major = buffer[0];
+	*minor = buffer[1];
+	*micro = buffer[2];
+	return 0;
+}
+
+
+
+int pk2aux_get_version(pk2aux_handle handle, unsigned int *major, unsigned int *minor, unsigned int *micro) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = get_version(handle, major, minor, micro);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+
+static int LIBUSB_CALL hotplug_event_cb(libusb_context *context, libusb_device *device, libusb_hotplug_event event, void *user_data) {
+	pk2aux_context ctx = user_data;
+	struct hotplug_event *tmp;
+	unsigned int new_size;
+
+	(void) context;
+
+	/* No I/O is allowed from inside a hotplug callback, so just note what happened. Any
+	 * thread handling libusb events can end up here, including one that is probing a device
+	 * on behalf of pk2aux_hotplug_poll(), so only the queue lock may be taken. */
+	pthread_mutex_lock(&ctx->hotplug_queue_lock);
+	if (ctx->hotplug_queue_used == ctx->hotplug_queue_size) {
+		new_size = ctx->hotplug_queue_size ? ctx->hotplug_queue_size * 2 : 8;
+		tmp = realloc(ctx->hotplug_queue, new_size * sizeof(*ctx->hotplug_queue));
+		if (!tmp) {
+			pthread_mutex_unlock(&ctx->hotplug_queue_lock);
+			return 0;
+		}
+		ctx->hotplug_queue = tmp;
+		ctx->hotplug_queue_size = new_size;
+	}
+
+	ctx->hotplug_queue[ctx->hotplug_queue_used].device = libusb_ref_device(device);
+	ctx->hotplug_queue[ctx->hotplug_queue_used].event = event;
+	ctx->hotplug_queue_used++;
+	pthread_mutex_unlock(&ctx->hotplug_queue_lock);
+	return 0;
+}
+
+
+
+static int find_usb_device(pk2aux_context ctx, libusb_device *device) {
+	unsigned int i;
+
+	/* The caller holds the context lock. */
+	for (i = 0; i < ctx->num_devices; ++i) {
+		if (((struct pk2aux_device_private *) ctx->devices[i]->private_data)->usb_device == device) {
+			return (int) i;
+		}
+	}
+
+	return -1;
+}
+
+
+
+static int device_arrived(pk2aux_context ctx, libusb_device *device) {
+	pk2aux_device candidate, *added = 0;
+	unsigned int old_num_devices;
+	int rc;
+
+	/* Devices already in the list are reported again when the callback is registered. */
+	pthread_mutex_lock(&ctx->lock);
+	old_num_devices = ctx->num_devices;
+	rc = find_usb_device(ctx, device);
+	pthread_mutex_unlock(&ctx->lock);
+	if (rc >= 0) {
+		return 0;
+	}
+
+	/* Give the new device the same treatment pk2aux_init() gave the others. Probing it waits
+	 * for USB traffic, so the context is not locked meanwhile. Only the thread applying
+	 * hotplug changes adds or removes devices, so the new one ends up last in the list. */
+	if ((rc = new_usb_device(ctx, device, &candidate)) < 0) {
+		return rc;
+	}
+	rc = scan_devices(ctx, &candidate, 1);
+	pk2aux_cache_save();
+
+	pthread_mutex_lock(&ctx->lock);
+	if (rc == 0 && ctx->num_devices > old_num_devices) {
+		added = ctx->devices[ctx->num_devices - 1];
+	}
+	pthread_mutex_unlock(&ctx->lock);
+
+	if (added && ctx->hotplug_callback) {
+		ctx->hotplug_callback(added, PK2AUX_HOTPLUG_ARRIVED, ctx->hotplug_user_data);
+	}
+
+	return rc;
+}
+
+
+
+static void device_left(pk2aux_context ctx, libusb_device *device) {
+	struct pk2aux_device_private *priv;
+	pk2aux_device *gone;
+	int index;
+
+	/* Take the device out of the list, but keep it until the context is freed, since the
+	 * application may still hold pointers to it. Once it is marked as gone nothing else
+	 * touches its USB resources, so they can be let go of without the lock. */
+	pthread_mutex_lock(&ctx->lock);
+	if ((index = find_usb_device(ctx, device)) < 0) {
+		pthread_mutex_unlock(&ctx->lock);
+		return;
+	}
+	gone = ctx->devices[index];
+	memmove(&ctx->devices[index], &ctx->devices[index + 1], (ctx->num_devices - index - 1) * sizeof(*ctx->devices));
+	ctx->num_devices--;
+	priv = gone->private_data;
+	priv->gone = 1;
+	priv->next = ctx->gone;
+	ctx->gone = gone;
+	pthread_mutex_unlock(&ctx->lock);
+	release_device(gone);
+
+	/* Whatever device gets this port and address next is a different one. */
+	if (priv->cache_key[0]) {
+		pk2aux_cache_invalidate(priv->cache_key);
+		pk2aux_cache_save();
+	}
+
+	if (ctx->hotplug_callback) {
+		ctx->hotplug_callback(gone, PK2AUX_HOTPLUG_LEFT, ctx->hotplug_user_data);
+	}
+}
+
+
+
+int pk2aux_context_hotplug_start(pk2aux_context ctx, pk2aux_hotplug_callback callback, void *user_data) {
+	int rc;
+
+	if (!ctx->usb_context) {
+		/* Simulated and replayed devices never come or go. */
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	pthread_mutex_lock(&ctx->hotplug_lock);
+	if (ctx->hotplug_registered) {
+		pthread_mutex_unlock(&ctx->hotplug_lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	ctx->hotplug_callback = callback;
+	ctx->hotplug_user_data = user_data;
+
+	/* Ask for the devices that are already present too, in case one arrived after
+	 * pk2aux_init() listed them; those that are already known are ignored. */
+	if ((rc = libusb_hotplug_register_callback(ctx->usb_context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			LIBUSB_HOTPLUG_ENUMERATE, VID_MICROCHIP, PID_PK2, LIBUSB_HOTPLUG_MATCH_ANY, &hotplug_event_cb, ctx, &ctx->hotplug_handle)) < 0) {
+		ctx->hotplug_callback = 0;
+		ctx->hotplug_user_data = 0;
+		pthread_mutex_unlock(&ctx->hotplug_lock);
+		return rc;
+	}
+
+	ctx->hotplug_registered = 1;
+	pthread_mutex_unlock(&ctx->hotplug_lock);
+	return 0;
+}
+
+
+
+void pk2aux_context_hotplug_stop(pk2aux_context ctx) {
+	unsigned int i;
+
+	pthread_mutex_lock(&ctx->hotplug_lock);
+
+	if (ctx->hotplug_registered) {
+		libusb_hotplug_deregister_callback(ctx->usb_context, ctx->hotplug_handle);
+		ctx->hotplug_registered = 0;
+	}
+
+	pthread_mutex_lock(&ctx->hotplug_queue_lock);
+	for (i = 0; i < ctx->hotplug_queue_used; ++i) {
+		libusb_unref_device(ctx->hotplug_queue[i].device);
+	}
+	free(ctx->hotplug_queue);
+	ctx->hotplug_queue = 0;
+	ctx->hotplug_queue_used = ctx->hotplug_queue_size = 0;
+	pthread_mutex_unlock(&ctx->hotplug_queue_lock);
+
+	ctx->hotplug_callback = 0;
+	ctx->hotplug_user_data = 0;
+
+	pthread_mutex_unlock(&ctx->hotplug_lock);
+}
+
+
+
+int pk2aux_context_hotplug_poll(pk2aux_context ctx, unsigned int timeout) {
+	struct hotplug_event *queue;
+	struct timeval tv;
+	unsigned int used, i;
+	int registered, rc;
+
+	pthread_mutex_lock(&ctx->hotplug_lock);
+	registered = ctx->hotplug_registered;
+	pthread_mutex_unlock(&ctx->hotplug_lock);
+	if (!registered) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	/* Let libusb notice any plugging and unplugging. The context is not locked meanwhile,
+	 * so other threads can go on opening its devices. */
+	tv.tv_sec = timeout / 1000U;
+	tv.tv_usec = (timeout % 1000U) * 1000U;
+	if ((rc = libusb_handle_events_timeout_completed(ctx->usb_context, &tv, 0)) < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+		return rc;
+	}
+
+	/* Take the queue as it stands. Probing an arrival may handle more events, which start a
+	 * new queue for the next poll. */
+	pthread_mutex_lock(&ctx->hotplug_lock);
+	pthread_mutex_lock(&ctx->hotplug_queue_lock);
+	queue = ctx->hotplug_queue;
+	used = ctx->hotplug_queue_used;
+	ctx->hotplug_queue = 0;
+	ctx->hotplug_queue_used = ctx->hotplug_queue_size = 0;
+	pthread_mutex_unlock(&ctx->hotplug_queue_lock);
+
+	/* Apply the changes one device at a time, in the order they happened. */
+	rc = 0;
+	for (i = 0; i < used; ++i) {
+		if (queue[i].event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+			if (rc == 0) {
+				rc = device_arrived(ctx, queue[i].device);
+			}
+		} else {
+			device_left(ctx, queue[i].device);
+		}
+		libusb_unref_device(queue[i].device);
+	}
+	pthread_mutex_unlock(&ctx->hotplug_lock);
+
+	free(queue);
+	return rc;
+}
+
+
+
+int pk2aux_hotplug_start(pk2aux_hotplug_callback callback, void *user_data) {
+	return default_context ? pk2aux_context_hotplug_start(default_context, callback, user_data) : LIBUSB_ERROR_INVALID_PARAM;
+}
+
+
+
+void pk2aux_hotplug_stop(void) {
+	if (default_context) {
+		pk2aux_context_hotplug_stop(default_context);
+	}
+}
+
+
+
+int pk2aux_hotplug_poll(unsigned int timeout) {
+	return default_context ? pk2aux_context_hotplug_poll(default_context, timeout) : LIBUSB_ERROR_INVALID_PARAM;
+}
+
+
+
+int pk2aux_context_get_pollfds(pk2aux_context ctx, pk2aux_pollfd *fds, unsigned int size) {
+	const struct libusb_pollfd **usb_fds;
+	unsigned int count;
+
+	if (!ctx->usb_context) {
+		return 0;
+	}
+
+	/* Not every platform has file descriptors to give out. */
+	usb_fds = libusb_get_pollfds(ctx->usb_context);
+	if (!usb_fds) {
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+	}
+
+	for (count = 0; usb_fds[count]; ++count) {
+		if (count < size) {
+			fds[count].fd = usb_fds[count]->fd;
+			fds[count].events = usb_fds[count]->events;
+		}
+	}
+
+	libusb_free_pollfds(usb_fds);
+	return (int) count;
+}
+
+
+
+int pk2aux_context_get_timeout(pk2aux_context ctx, struct timeval *tv) {
+	/* Simulated and replayed devices only move on when asked, so ask to be asked often. */
+	if (!ctx->usb_context) {
+		tv->tv_sec = 0;
+		tv->tv_usec = 1000;
+		return 1;
+	}
+
+	return libusb_get_next_timeout(ctx->usb_context, tv);
+}
+
+
+
+int pk2aux_context_handle_events(pk2aux_context ctx) {
+	struct timeval tv;
+	int rc;
+
+	if (!ctx->usb_context) {
+		return 0;
+	}
+
+	/* Hotplug events are only queued here. Applying them can mean probing new devices, which
+	 * is left to pk2aux_hotplug_poll() so that an event loop never waits on it. */
+	tv.tv_sec = 0;
+	tv.tv_usec = 0;
+	if ((rc = libusb_handle_events_timeout_completed(ctx->usb_context, &tv, 0)) < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+		return rc;
+	}
+	return 0;
+}
+
+
+
+int pk2aux_get_pollfds(pk2aux_pollfd *fds, unsigned int size) {
+	return default_context ? pk2aux_context_get_pollfds(default_context, fds, size) : LIBUSB_ERROR_INVALID_PARAM;
+}
+
+
+
+int pk2aux_get_timeout(struct timeval *tv) {
+	return default_context ? pk2aux_context_get_timeout(default_context, tv) : LIBUSB_ERROR_INVALID_PARAM;
+}
+
+
+
+int pk2aux_handle_events(void) {
+	return default_context ? pk2aux_context_handle_events(default_context) : LIBUSB_ERROR_INVALID_PARAM;
+}
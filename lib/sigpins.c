@@ -45,31 +45,69 @@ static int query_pg(pk2aux_handle handle, unsigned char *result) {
 
 
 
-static int get_pg_modes(pk2aux_handle handle, enum PIN_MODE *pgc, enum PIN_MODE *pgd) {
+int pk2aux_refresh_pg_shadow(pk2aux_handle handle) {
 	int rc;
-	unsigned char levels;
+	unsigned char buffer[64];
 
-	if (handle->pgc_floating && handle->pgd_floating) {
-		/* No need to waste USB bandwidth in this case. */
-		if (pgc) {
-			*pgc = PIN_MODE_FLOATING;
-		}
-		if (pgd) {
-			*pgd = PIN_MODE_FLOATING;
-		}
-		return 0;
+	/* The firmware doesn't contain any commands directly intended to probe
+	 * for the current state of the pins (i.e. whether VDD/VPP/PGC/PGD/AUX
+	 * are grounded, high, or floating). Unfortunately, the PGC and PGD pins
+	 * are tied together in such a way that the only SET command that affects
+	 * either of those pins sets the states of both pins simultaneously. This
+	 * means it is impossible to write a function to set the state of one pin
+	 * without changing the state of the other pin, in the general case. Since
+	 * this would be highly desirable functionality, the code following is a
+	 * horrible horrible hack which accomplishes just that: it uses the PEEK SFR
+	 * function to peek at the TRISA register in order to determine whether each
+	 * of PGC and PGD are currently inputs or outputs. The same script also reads
+	 * the ICSP_STATES_BUFFER, which gives the driven level of any output. */
+	buffer[0] = EXECUTE_SCRIPT;
+	buffer[1] = 3;
+	buffer[2] = PEEK_SFR;
+	buffer[3] = 0x92; /* TRISA */
+	buffer[4] = ICSP_STATES_BUFFER;
+	buffer[5] = UPLOAD_DATA;
+	if ((rc = pk2aux_write(handle, buffer, 6)) < 0) {
+		return rc;
 	}
 
-	if ((rc = query_pg(handle, &levels)) < 0) {
+	if ((rc = pk2aux_read(handle, buffer)) < 0) {
 		return rc;
 	}
 
+	assert(buffer[0] == 2);
+	pk2aux_decode_pg_shadow(handle, buffer + 1);
+	return 0;
+}
+
+
+
+void pk2aux_decode_pg_shadow(pk2aux_handle handle, const unsigned char *state) {
+	/* The first byte is TRISA and the second the ICSP_STATES_BUFFER byte. PGC is RA3. */
+	handle->shadow.pgc_mode = (state[0] & 0x08) ? PIN_MODE_FLOATING : (state[1] & 0x01) ? PIN_MODE_HIGH : PIN_MODE_GROUNDED;
+	/* PGD is RA2. */
+	handle->shadow.pgd_mode = (state[0] & 0x04) ? PIN_MODE_FLOATING : (state[1] & 0x02) ? PIN_MODE_HIGH : PIN_MODE_GROUNDED;
+	handle->shadow.known |= PK2AUX_PIN_PGC | PK2AUX_PIN_PGD;
+}
+
+
+
+static int get_pg_modes(pk2aux_handle handle, enum PIN_MODE *pgc, enum PIN_MODE *pgd) {
+	int rc;
+
+	/* Once the modes are known, they only change through set_pg_modes. */
+	if ((handle->shadow.known & (PK2AUX_PIN_PGC | PK2AUX_PIN_PGD)) != (PK2AUX_PIN_PGC | PK2AUX_PIN_PGD)) {
+		if ((rc = pk2aux_refresh_pg_shadow(handle)) < 0) {
+			return rc;
+		}
+	}
+
 	if (pgc) {
-		*pgc = handle->pgc_floating ? PIN_MODE_FLOATING : ((levels & 0x01) ? PIN_MODE_HIGH : PIN_MODE_GROUNDED);
+		*pgc = handle->shadow.pgc_mode;
 	}
 
 	if (pgd) {
-		*pgd = handle->pgd_floating ? PIN_MODE_FLOATING : ((levels & 0x02) ? PIN_MODE_HIGH : PIN_MODE_GROUNDED);
+		*pgd = handle->shadow.pgd_mode;
 	}
 
 	return 0;
@@ -103,6 +141,18 @@ static int set_pg_modes(pk2aux_handle handle, enum PIN_MODE pgc, enum PIN_MODE p
 	unsigned char pgc_bits, pgd_bits;
 	unsigned char buffer[4];
 
+	if (pgc != PIN_MODE_GROUNDED && pgc != PIN_MODE_FLOATING && pgc != PIN_MODE_HIGH) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+	if (pgd != PIN_MODE_GROUNDED && pgd != PIN_MODE_FLOATING && pgd != PIN_MODE_HIGH) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	/* get_pg_modes has always been called first, so the shadow is valid here. */
+	if (handle->shadow.pgc_mode == pgc && handle->shadow.pgd_mode == pgd) {
+		return 0;
+	}
+
 	pgc_bits = pgc == PIN_MODE_FLOATING ? 0x01 : pgc == PIN_MODE_HIGH ? 0x04 : 0x00;
 	pgd_bits = pgd == PIN_MODE_FLOATING ? 0x02 : pgd == PIN_MODE_HIGH ? 0x08 : 0x00;
 
@@ -114,17 +164,19 @@ static int set_pg_modes(pk2aux_handle handle, enum PIN_MODE pgc, enum PIN_MODE p
 		return rc;
 	}
 
-	handle->pgc_floating = pgc == PIN_MODE_FLOATING;
-	handle->pgd_floating = pgd == PIN_MODE_FLOATING;
+	handle->shadow.pgc_mode = pgc;
+	handle->shadow.pgd_mode = pgd;
 	return 0;
 }
 
 
 
-int pk2aux_set_pgc(pk2aux_handle handle, enum PIN_MODE mode) {
+static int set_pgc(pk2aux_handle handle, enum PIN_MODE mode) {
 	int rc;
 	enum PIN_MODE pgd_mode;
 
+	handle->api = PK2AUX_API_SET_PGC;
+
 	if ((rc = get_pg_modes(handle, 0, &pgd_mode)) < 0) {
 		return rc;
 	}
@@ -134,10 +186,23 @@ int pk2aux_set_pgc(pk2aux_handle handle, enum PIN_MODE mode) {
 
 
 
-int pk2aux_set_pgd(pk2aux_handle handle, enum PIN_MODE mode) {
+int pk2aux_set_pgc(pk2aux_handle handle, enum PIN_MODE mode) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_pgc(handle, mode);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int set_pgd(pk2aux_handle handle, enum PIN_MODE mode) {
 	int rc;
 	enum PIN_MODE pgc_mode;
 
+	handle->api = PK2AUX_API_SET_PGD;
+
 	if ((rc = get_pg_modes(handle, &pgc_mode, 0)) < 0) {
 		return rc;
 	}
@@ -147,35 +212,101 @@ int pk2aux_set_pgd(pk2aux_handle handle, enum PIN_MODE mode) {
 
 
 
-int pk2aux_set_aux(pk2aux_handle handle, enum PIN_MODE mode) {
+int pk2aux_set_pgd(pk2aux_handle handle, enum PIN_MODE mode) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_pgd(handle, mode);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int set_aux(pk2aux_handle handle, enum PIN_MODE mode) {
+	int rc;
 	unsigned char buffer[4];
 
+	handle->api = PK2AUX_API_SET_AUX;
+
+	if (mode != PIN_MODE_GROUNDED && mode != PIN_MODE_FLOATING && mode != PIN_MODE_HIGH) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	if ((handle->shadow.known & PK2AUX_PIN_AUX) && handle->shadow.aux_mode == mode) {
+		return 0;
+	}
+
 	buffer[0] = EXECUTE_SCRIPT;
 	buffer[1] = 2;
 	buffer[2] = SET_AUX;
 	buffer[3] = mode == PIN_MODE_FLOATING ? 0x01 : mode == PIN_MODE_HIGH ? 0x02 : 0x00;
+	if ((rc = pk2aux_write(handle, buffer, 4)) < 0) {
+		return rc;
+	}
 
-	return pk2aux_write(handle, buffer, 4);
+	handle->shadow.aux_mode = mode;
+	handle->shadow.known |= PK2AUX_PIN_AUX;
+	return 0;
 }
 
 
 
-int pk2aux_get_pgc(pk2aux_handle handle, unsigned int *level) {
+int pk2aux_set_aux(pk2aux_handle handle, enum PIN_MODE mode) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_aux(handle, mode);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int get_pgc(pk2aux_handle handle, unsigned int *level) {
+	handle->api = PK2AUX_API_GET_PGC;
+
 	return get_pg_levels(handle, level, 0);
 }
 
 
 
-int pk2aux_get_pgd(pk2aux_handle handle, unsigned int *level) {
+int pk2aux_get_pgc(pk2aux_handle handle, unsigned int *level) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = get_pgc(handle, level);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int get_pgd(pk2aux_handle handle, unsigned int *level) {
+	handle->api = PK2AUX_API_GET_PGD;
+
 	return get_pg_levels(handle, 0, level);
 }
 
 
 
-int pk2aux_get_aux(pk2aux_handle handle, unsigned int *level) {
+int pk2aux_get_pgd(pk2aux_handle handle, unsigned int *level) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = get_pgd(handle, level);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int get_aux(pk2aux_handle handle, unsigned int *level) {
 	int rc;
 	unsigned char buffer[64];
 
+	handle->api = PK2AUX_API_GET_AUX;
+
 	buffer[0] = EXECUTE_SCRIPT;
 	buffer[1] = 1;
 	buffer[2] = AUX_STATE_BUFFER;
@@ -194,3 +325,13 @@ int pk2aux_get_aux(pk2aux_handle handle, unsigned int *level) {
 	return 0;
 }
 
+
+
+int pk2aux_get_aux(pk2aux_handle handle, unsigned int *level) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = get_aux(handle, level);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
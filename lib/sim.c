@@ -0,0 +1,679 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cmd.h"
+#include "internal.h"
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+
+/* A software model of a PICkit2 running firmware 2.32, reached through the simulated
+ * transport instead of USB. It understands the commands and script commands this
+ * library sends and keeps enough device state to answer them plausibly. The USB side
+ * is modelled as a full speed interrupt pipe polled once per 1 ms frame in each
+ * direction: an OUT packet is taken by the device at the first free frame after it
+ * is submitted, and each response becomes readable at the first free frame after the
+ * packet causing it was taken. The UART drains the download buffer at the configured
+ * baud rate and its transmit line is looped back to its receive line. All times are
+ * in microseconds on CLOCK_MONOTONIC. */
+
+/* The length of a USB frame. */
+#define SIM_FRAME 1000LL
+
+/* How many responses the device can have waiting to be read. */
+#define SIM_IN_QUEUE 16
+
+/* The sizes of the firmware's data buffers. */
+#define SIM_DOWNLOAD_SIZE 256
+#define SIM_UPLOAD_SIZE 128
+
+struct sim_packet {
+	unsigned char data[64];
+	long long time;
+};
+
+struct pk2aux_sim {
+	int claimed;
+
+	/* Packets submitted but not yet taken by the device, and responses not yet read. */
+	struct sim_packet out[PK2AUX_NUM_TRANSFERS];
+	unsigned int out_head, out_count;
+	struct sim_packet in[SIM_IN_QUEUE];
+	unsigned int in_head, in_count;
+	long long last_out_frame, last_in_frame;
+
+	/* When each of the host's IN transfers was posted, oldest first. */
+	long long posted[PK2AUX_NUM_TRANSFERS];
+	unsigned int posted_head;
+
+	/* Firmware state. */
+	unsigned char eeprom[256];
+	unsigned char vdd_ccpr[2], vpp_adc;
+	int vdd_on, vdd_gnd, vpp_on, mclr_gnd, vpp_pwm;
+	unsigned char icsp_pins, aux_pins;
+	unsigned char download[SIM_DOWNLOAD_SIZE], upload[SIM_UPLOAD_SIZE];
+	size_t download_used, upload_used;
+	int uart;
+	double uart_baud, uart_time;
+};
+
+
+
+static long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+
+static void sleep_until(long long when) {
+	struct timespec ts;
+
+	ts.tv_sec = when / 1000000LL;
+	ts.tv_nsec = (when % 1000000LL) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0) == EINTR);
+}
+
+
+
+static long long next_frame(long long time, long long last_frame) {
+	/* The first frame boundary strictly after the given time, but no earlier than
+	 * the frame after the last one this direction of the pipe was used in. */
+	time = (time / SIM_FRAME + 1) * SIM_FRAME;
+	return time > last_frame + SIM_FRAME ? time : last_frame + SIM_FRAME;
+}
+
+
+
+static void reset_state(struct pk2aux_sim *sim) {
+	sim->vdd_ccpr[0] = 0x00;
+	sim->vdd_ccpr[1] = 0x1D; /* 3.3 V */
+	sim->vpp_adc = 0;
+	sim->vdd_on = sim->vpp_on = sim->vpp_pwm = 0;
+	sim->vdd_gnd = sim->mclr_gnd = 0;
+	sim->icsp_pins = 0x03;
+	sim->aux_pins = 0x01;
+	sim->download_used = sim->upload_used = 0;
+	sim->uart = 0;
+}
+
+
+
+static void upload_put(struct pk2aux_sim *sim, unsigned char byte) {
+	/* Like the firmware, drop data that doesn't fit. */
+	if (sim->upload_used < sizeof(sim->upload)) {
+		sim->upload[sim->upload_used++] = byte;
+	}
+}
+
+
+
+static void respond(struct pk2aux_sim *sim, const unsigned char *data, size_t length, long long time) {
+	struct sim_packet *packet;
+
+	/* A device whose responses are not being read stops taking them. */
+	if (sim->in_count == SIM_IN_QUEUE) {
+		return;
+	}
+
+	packet = &sim->in[(sim->in_head + sim->in_count) % SIM_IN_QUEUE];
+	memset(packet->data, 0, sizeof(packet->data));
+	memcpy(packet->data, data, length);
+	packet->time = sim->last_in_frame = next_frame(time, sim->last_in_frame);
+	sim->in_count++;
+}
+
+
+
+static void drain_uart(struct pk2aux_sim *sim, long long time) {
+	size_t chars, i;
+
+	if (!sim->uart || sim->uart_time >= time) {
+		return;
+	}
+
+	/* Each character takes ten bit times. Whatever is sent comes straight back. */
+	chars = (size_t) ((time - sim->uart_time) * sim->uart_baud / 10.0e6);
+	if (chars >= sim->download_used) {
+		chars = sim->download_used;
+		sim->uart_time = time;
+	} else {
+		sim->uart_time += chars * 10.0e6 / sim->uart_baud;
+	}
+
+	for (i = 0; i < chars; ++i) {
+		upload_put(sim, sim->download[i]);
+	}
+	memmove(sim->download, sim->download + chars, sim->download_used - chars);
+	sim->download_used -= chars;
+}
+
+
+
+static unsigned char icsp_levels(const struct pk2aux_sim *sim) {
+	/* Bits 0 and 1 of SET_ICSP_PINS float PGC and PGD, and bits 2 and 3 drive them high.
+	 * Nothing is attached, so a floating pin reads low. */
+	return ((sim->icsp_pins & 0x05) == 0x04 ? 0x01 : 0x00) | ((sim->icsp_pins & 0x0A) == 0x08 ? 0x02 : 0x00);
+}
+
+
+
+static void run_script(struct pk2aux_sim *sim, const unsigned char *script, size_t length) {
+	size_t i = 0;
+
+	while (i < length) {
+		switch (script[i++]) {
+			case VDD_ON:
+				sim->vdd_on = 1;
+				break;
+
+			case VDD_OFF:
+				sim->vdd_on = 0;
+				break;
+
+			case VDD_GND_ON:
+				sim->vdd_gnd = 1;
+				break;
+
+			case VDD_GND_OFF:
+				sim->vdd_gnd = 0;
+				break;
+
+			case VPP_ON:
+				sim->vpp_on = 1;
+				break;
+
+			case VPP_OFF:
+				sim->vpp_on = 0;
+				break;
+
+			case MCLR_GND_ON:
+				sim->mclr_gnd = 1;
+				break;
+
+			case MCLR_GND_OFF:
+				sim->mclr_gnd = 0;
+				break;
+
+			case VPP_PWM_ON:
+				sim->vpp_pwm = 1;
+				break;
+
+			case VPP_PWM_OFF:
+				sim->vpp_pwm = 0;
+				break;
+
+			case BUSY_LED_ON:
+			case BUSY_LED_OFF:
+				break;
+
+			case SET_ICSP_PINS:
+				if (i < length) {
+					sim->icsp_pins = script[i++];
+				}
+				break;
+
+			case SET_AUX:
+				if (i < length) {
+					sim->aux_pins = script[i++];
+				}
+				break;
+
+			case ICSP_STATES_BUFFER:
+				upload_put(sim, icsp_levels(sim));
+				break;
+
+			case AUX_STATE_BUFFER:
+				upload_put(sim, (sim->aux_pins & 0x03) == 0x02 ? 0x01 : 0x00);
+				break;
+
+			case PEEK_SFR:
+				if (i < length) {
+					/* Only TRISA is modelled: RA3 is PGC and RA2 is PGD. */
+					upload_put(sim, script[i++] == 0x92 ? (unsigned char) (((sim->icsp_pins & 0x01) << 3) | ((sim->icsp_pins & 0x02) << 1)) : 0x00);
+				}
+				break;
+
+			case POKE_SFR:
+				i += 2;
+				break;
+
+			case DELAY_SHORT:
+			case DELAY_LONG:
+				i++;
+				break;
+
+			default:
+				/* Anything else is beyond this model. */
+				return;
+		}
+	}
+}
+
+
+
+static void encode_voltage(unsigned char *buffer, double voltage, double full_scale) {
+	unsigned int adc = voltage <= 0.0 ? 0 : voltage >= full_scale ? 65535 : (unsigned int) (voltage / full_scale * 65536.0);
+
+	buffer[0] = (unsigned char) (adc & 0xFF);
+	buffer[1] = (unsigned char) (adc >> 8);
+}
+
+
+
+static void execute(struct pk2aux_sim *sim, const unsigned char *packet, long long time) {
+	unsigned char response[64];
+	size_t i = 0, n;
+	unsigned int brg;
+	double vdd, vpp;
+
+	/* Each command's arguments must fit in what's left of the packet; if they don't, or
+	 * the command is unknown, the rest of the packet is ignored as the firmware would. */
+#define NEED(x) if (i + (x) > 64) return
+	while (i < 64) {
+		switch (packet[i++]) {
+			case NO_OPERATION:
+				break;
+
+			case END_OF_BUFFER:
+				return;
+
+			case FIRMWARE_VERSION:
+				response[0] = 2;
+				response[1] = 32;
+				response[2] = 0;
+				respond(sim, response, 3, time);
+				break;
+
+			case SETVDD:
+				NEED(3);
+				sim->vdd_ccpr[0] = packet[i];
+				sim->vdd_ccpr[1] = packet[i + 1];
+				i += 3;
+				break;
+
+			case SETVPP:
+				NEED(3);
+				sim->vpp_adc = packet[i + 1];
+				i += 3;
+				break;
+
+			case READ_STATUS:
+				response[0] = (unsigned char) ((sim->vdd_on ? 0x01 : 0) | (sim->vdd_gnd ? 0x02 : 0) | (sim->vpp_on ? 0x04 : 0) | (sim->mclr_gnd ? 0x08 : 0) | (sim->vpp_pwm ? 0x10 : 0));
+				response[1] = 0;
+				respond(sim, response, 2, time);
+				break;
+
+			case READ_VOLTAGES:
+				/* The regulator output follows its duty cycle, and the pump its ADC target. */
+				vdd = sim->vdd_on && !sim->vdd_gnd ? (((sim->vdd_ccpr[0] | sim->vdd_ccpr[1] << 8) >> 6) - 10.5) / 32.0 : 0.0;
+				vpp = sim->vpp_pwm ? sim->vpp_adc / 18.61 : 0.0;
+				encode_voltage(response, vdd, 5.0);
+				encode_voltage(response + 2, vpp, 13.7);
+				respond(sim, response, 4, time);
+				break;
+
+			case EXECUTE_SCRIPT:
+				NEED(1);
+				n = packet[i++];
+				NEED(n);
+				run_script(sim, packet + i, n);
+				i += n;
+				break;
+
+			case CLR_DOWNLOAD_BUFFER:
+				sim->download_used = 0;
+				break;
+
+			case DOWNLOAD_DATA:
+				NEED(1);
+				n = packet[i++];
+				NEED(n);
+				/* An idle transmitter starts on new data straight away. A busy one carries on
+				 * with the character it is part way through. */
+				if (sim->uart && !sim->download_used && sim->uart_time < time) {
+					sim->uart_time = time;
+				}
+				for (; n; --n, ++i) {
+					if (sim->download_used < sizeof(sim->download)) {
+						sim->download[sim->download_used++] = packet[i];
+					}
+				}
+				break;
+
+			case CLR_UPLOAD_BUFFER:
+				sim->upload_used = 0;
+				break;
+
+			case UPLOAD_DATA:
+				n = sim->upload_used < 63 ? sim->upload_used : 63;
+				response[0] = (unsigned char) n;
+				memcpy(response + 1, sim->upload, n);
+				memmove(sim->upload, sim->upload + n, sim->upload_used - n);
+				sim->upload_used -= n;
+				respond(sim, response, n + 1, time);
+				break;
+
+			case UPLOAD_DATA_NOLEN:
+				n = sim->upload_used < 64 ? sim->upload_used : 64;
+				memcpy(response, sim->upload, n);
+				memmove(sim->upload, sim->upload + n, sim->upload_used - n);
+				sim->upload_used -= n;
+				respond(sim, response, n, time);
+				break;
+
+			case RESET:
+				/* Responses not yet read are lost as the device drops off the bus. */
+				reset_state(sim);
+				sim->in_count = 0;
+				return;
+
+			case WR_INTERNAL_EE:
+				NEED(2);
+				n = packet[i + 1];
+				NEED(2 + n);
+				if (packet[i] + n <= sizeof(sim->eeprom)) {
+					memcpy(sim->eeprom + packet[i], packet + i + 2, n);
+				}
+				i += 2 + n;
+				break;
+
+			case RD_INTERNAL_EE:
+				NEED(2);
+				n = packet[i + 1];
+				if (n > 64 || packet[i] + n > sizeof(sim->eeprom)) {
+					return;
+				}
+				memcpy(response, sim->eeprom + packet[i], n);
+				respond(sim, response, n, time);
+				i += 2;
+				break;
+
+			case ENTER_UART_MODE:
+				NEED(2);
+				brg = packet[i] | packet[i + 1] << 8;
+				i += 2;
+				sim->uart = 1;
+				sim->uart_baud = 1.0 / ((65536 - brg) * 1.67e-7 + 3.0e-6);
+				sim->uart_time = (double) time;
+				sim->download_used = sim->upload_used = 0;
+				break;
+
+			case EXIT_UART_MODE:
+				sim->uart = 0;
+				break;
+
+			default:
+				return;
+		}
+	}
+#undef NEED
+}
+
+
+
+static void advance(struct pk2aux_sim *sim, long long time) {
+	struct sim_packet *packet;
+
+	/* Let the device take every packet due by now, with the UART running in between. */
+	while (sim->out_count && sim->out[sim->out_head].time <= time) {
+		packet = &sim->out[sim->out_head];
+		drain_uart(sim, packet->time);
+		execute(sim, packet->data, packet->time);
+		sim->out_head = (sim->out_head + 1) % PK2AUX_NUM_TRANSFERS;
+		sim->out_count--;
+	}
+	drain_uart(sim, time);
+}
+
+
+
+static long long limit(const struct pk2aux_engine *engine, long long start) {
+	long long result = engine->timeout ? start + engine->timeout * 1000LL : -1;
+	long long deadline;
+
+	if (engine->has_deadline) {
+		deadline = engine->deadline.tv_sec * 1000000LL + engine->deadline.tv_nsec / 1000;
+		if (result < 0 || deadline < result) {
+			result = deadline;
+		}
+	}
+
+	return result;
+}
+
+
+
+static int wait_for(struct pk2aux_engine *engine, long long when, long long give_up) {
+	/* Wait until the given time, unless that is after the time to give up. */
+	if (give_up >= 0 && when > give_up) {
+		sleep_until(give_up);
+		advance(engine->sim, give_up);
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	sleep_until(when);
+	advance(engine->sim, when);
+	return 0;
+}
+
+
+
+static int sim_open(struct pk2aux_device_private *device, struct pk2aux_engine *engine) {
+	/* Only one handle may claim the interface at a time. */
+	if (device->sim->claimed) {
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	device->sim->claimed = 1;
+	engine->sim = device->sim;
+	return 0;
+}
+
+
+
+static void sim_close(struct pk2aux_engine *engine, int reset) {
+	if (reset) {
+		reset_state(engine->sim);
+	}
+	engine->sim->claimed = 0;
+}
+
+
+
+static int sim_flush(struct pk2aux_engine *engine) {
+	struct pk2aux_sim *sim = engine->sim;
+	long long give_up = limit(engine, now_us());
+
+	advance(sim, now_us());
+	if (sim->out_count) {
+		return wait_for(engine, sim->out[(sim->out_head + sim->out_count - 1) % PK2AUX_NUM_TRANSFERS].time, give_up);
+	}
+
+	return 0;
+}
+
+
+
+static void sim_stop(struct pk2aux_engine *engine) {
+	struct pk2aux_sim *sim = engine->sim;
+	long long last;
+
+	/* As with USB, writes are delivered and responses nobody has read are thrown away. */
+	if (sim->out_count) {
+		last = sim->out[(sim->out_head + sim->out_count - 1) % PK2AUX_NUM_TRANSFERS].time;
+		sleep_until(last);
+		advance(sim, last);
+	}
+	sim->in_count = 0;
+}
+
+
+
+static int sim_start(struct pk2aux_engine *engine) {
+	struct pk2aux_sim *sim = engine->sim;
+	long long now = now_us();
+	unsigned int i;
+
+	/* Like the USB transport, keep every IN transfer posted. */
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		sim->posted[i] = now;
+	}
+	sim->posted_head = 0;
+	return 0;
+}
+
+
+
+static long long arrival(const struct pk2aux_sim *sim) {
+	long long posted = (sim->posted[sim->posted_head] / SIM_FRAME + 1) * SIM_FRAME;
+
+	/* The next response reaches the host once it is ready and the IN transfer that will
+	 * carry it has been posted for at least the start of a frame. */
+	return sim->in[sim->in_head].time > posted ? sim->in[sim->in_head].time : posted;
+}
+
+
+
+static int sim_reserve(struct pk2aux_engine *engine, unsigned char **buffer) {
+	struct pk2aux_sim *sim = engine->sim;
+	long long now = now_us();
+	int rc;
+
+	/* If every OUT transfer is still in flight, wait for the oldest to be taken. */
+	advance(sim, now);
+	if (sim->out_count == PK2AUX_NUM_TRANSFERS) {
+		if ((rc = wait_for(engine, sim->out[sim->out_head].time, limit(engine, now))) < 0) {
+			return rc;
+		}
+	}
+
+	*buffer = sim->out[(sim->out_head + sim->out_count) % PK2AUX_NUM_TRANSFERS].data;
+	return 0;
+}
+
+
+
+static int sim_submit(struct pk2aux_engine *engine, size_t length) {
+	struct pk2aux_sim *sim = engine->sim;
+	struct sim_packet *packet;
+
+	/* Anything taken in the meantime came off the head, so the reserved packet is still
+	 * the one after the last. */
+	packet = &sim->out[(sim->out_head + sim->out_count) % PK2AUX_NUM_TRANSFERS];
+	memset(packet->data + length, END_OF_BUFFER, sizeof(packet->data) - length);
+	packet->time = sim->last_out_frame = next_frame(now_us(), sim->last_out_frame);
+	sim->out_count++;
+	return 0;
+}
+
+
+
+static int sim_read(struct pk2aux_engine *engine, void *data) {
+	struct pk2aux_sim *sim = engine->sim;
+	long long now = now_us(), give_up = limit(engine, now);
+	int rc;
+
+	for (;;) {
+		advance(sim, now);
+		if (sim->in_count && arrival(sim) <= now) {
+			break;
+		}
+
+		if (sim->in_count) {
+			rc = wait_for(engine, arrival(sim), give_up);
+		} else if (sim->out_count) {
+			rc = wait_for(engine, sim->out[sim->out_head].time, give_up);
+		} else if (give_up >= 0) {
+			/* No response is coming. */
+			rc = wait_for(engine, give_up + 1, give_up);
+		} else {
+			/* No response is coming and there is no timeout; real hardware would hang
+			 * here, but a simulation has nothing to gain by doing the same. */
+			rc = LIBUSB_ERROR_TIMEOUT;
+		}
+		if (rc < 0) {
+			sim->in_count = 0;
+			return rc;
+		}
+		now = now_us();
+	}
+
+	memcpy(data, sim->in[sim->in_head].data, 64);
+	sim->in_head = (sim->in_head + 1) % SIM_IN_QUEUE;
+	sim->in_count--;
+	sim->posted[sim->posted_head] = now;
+	sim->posted_head = (sim->posted_head + 1) % PK2AUX_NUM_TRANSFERS;
+	return 0;
+}
+
+
+
+static int sim_ready(struct pk2aux_engine *engine) {
+	struct pk2aux_sim *sim = engine->sim;
+	long long now = now_us();
+
+	advance(sim, now);
+	return sim->in_count && arrival(sim) <= now;
+}
+
+
+
+struct pk2aux_sim *pk2aux_sim_new(unsigned int index) {
+	struct pk2aux_sim *sim;
+
+	sim = calloc(1, sizeof(*sim));
+	if (!sim) {
+		return 0;
+	}
+
+	/* Give each simulated device a unit ID so that it can be told apart from the others. */
+	memset(sim->eeprom, 0xFF, sizeof(sim->eeprom));
+	memset(sim->eeprom + 0xF0, 0, 16);
+	sim->eeprom[0xF0] = '#';
+	snprintf((char *) sim->eeprom + 0xF1, 15, "sim%u", index);
+	reset_state(sim);
+
+	return sim;
+}
+
+
+
+void pk2aux_sim_free(struct pk2aux_sim *sim) {
+	free(sim);
+}
+
+
+
+const struct pk2aux_transport pk2aux_sim_transport = {
+	&sim_open,
+	&sim_close,
+	&sim_start,
+	&sim_stop,
+	&sim_reserve,
+	&sim_submit,
+	&sim_read,
+	&sim_flush,
+	&sim_ready
+};
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cmd.h"
+#include "internal.h"
+#include <assert.h>
+
+
+
+static int get_snapshot(pk2aux_handle handle, pk2aux_snapshot *snapshot) {
+	int rc;
+	unsigned char buffer[64];
+
+	handle->api = PK2AUX_API_GET_SNAPSHOT;
+
+	/* One script samples the PGC/PGD and AUX states into the upload buffer and
+	 * UPLOAD_DATA returns both; READ_VOLTAGES in the same packet then produces a
+	 * second response. */
+	buffer[0] = EXECUTE_SCRIPT;
+	buffer[1] = 2;
+	buffer[2] = ICSP_STATES_BUFFER;
+	buffer[3] = AUX_STATE_BUFFER;
+	buffer[4] = UPLOAD_DATA;
+	buffer[5] = READ_VOLTAGES;
+	if ((rc = pk2aux_write(handle, buffer, 6)) < 0) {
+		return rc;
+	}
+
+	if ((rc = pk2aux_read(handle, buffer)) < 0) {
+		return rc;
+	}
+
+	assert(buffer[0] == 2);
+	snapshot->pgc_level = (buffer[1] & 0x01) ? 1 : 0;
+	snapshot->pgd_level = (buffer[1] & 0x02) ? 1 : 0;
+	snapshot->aux_level = (buffer[2] & 0x01) ? 1 : 0;
+
+	if ((rc = pk2aux_read(handle, buffer)) < 0) {
+		return rc;
+	}
+
+	pk2aux_decode_voltages(buffer, &snapshot->vdd_level, &snapshot->vpp_level);
+
+	/* The modes come from the shadow of what has been set through this handle. */
+	snapshot->modes_known = handle->shadow.known & (PK2AUX_PIN_VDD | PK2AUX_PIN_VPP | PK2AUX_PIN_PGC | PK2AUX_PIN_PGD | PK2AUX_PIN_AUX);
+	snapshot->vdd_mode = handle->shadow.vdd_mode;
+	snapshot->vpp_mode = handle->shadow.vpp_mode;
+	snapshot->pgc_mode = handle->shadow.pgc_mode;
+	snapshot->pgd_mode = handle->shadow.pgd_mode;
+	snapshot->aux_mode = handle->shadow.aux_mode;
+
+	return 0;
+}
+
+
+
+int pk2aux_get_snapshot(pk2aux_handle handle, pk2aux_snapshot *snapshot) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = get_snapshot(handle, snapshot);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
@@ -0,0 +1,382 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cmd.h"
+#include "internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+
+static const char * const API_NAMES[PK2AUX_API_COUNT] = {
+	"other",
+	"open",
+	"close",
+	"reset",
+	"batch_commit",
+	"get_version",
+	"set_id",
+	"set_vdd_mode",
+	"set_vdd_level",
+	"get_vdd_level",
+	"set_vpp_mode",
+	"set_vpp_level",
+	"stop_vpp_pump",
+	"get_vpp_level",
+	"set_pgc",
+	"set_pgd",
+	"set_aux",
+	"get_pgc",
+	"get_pgd",
+	"get_aux",
+	"get_snapshot",
+	"start_uart",
+	"stop_uart",
+	"receive_uart",
+	"send_uart",
+	"request_uart",
+	"submit",
+	"collect",
+	"queue_uart",
+	"pump_uart",
+	"flush_uart",
+	"uart_pump",
+	"exchange_uart"
+};
+
+
+
+static const char * const OPCODE_NAMES[256] = {
+	[NO_OPERATION] = "NO_OPERATION",
+	[FIRMWARE_VERSION] = "FIRMWARE_VERSION",
+	[SETVDD] = "SETVDD",
+	[SETVPP] = "SETVPP",
+	[READ_STATUS] = "READ_STATUS",
+	[READ_VOLTAGES] = "READ_VOLTAGES",
+	[EXECUTE_SCRIPT] = "EXECUTE_SCRIPT",
+	[CLR_DOWNLOAD_BUFFER] = "CLR_DOWNLOAD_BUFFER",
+	[DOWNLOAD_DATA] = "DOWNLOAD_DATA",
+	[CLR_UPLOAD_BUFFER] = "CLR_UPLOAD_BUFFER",
+	[UPLOAD_DATA] = "UPLOAD_DATA",
+	[UPLOAD_DATA_NOLEN] = "UPLOAD_DATA_NOLEN",
+	[RESET] = "RESET",
+	[WR_INTERNAL_EE] = "WR_INTERNAL_EE",
+	[RD_INTERNAL_EE] = "RD_INTERNAL_EE",
+	[ENTER_UART_MODE] = "ENTER_UART_MODE",
+	[EXIT_UART_MODE] = "EXIT_UART_MODE"
+};
+
+
+
+static long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+
+static void count_result(pk2aux_stats_entry *entry, int rc, unsigned long retries) {
+	entry->retries += retries;
+	if (rc == LIBUSB_ERROR_TIMEOUT) {
+		entry->timeouts++;
+	} else if (rc < 0) {
+		entry->errors++;
+	}
+}
+
+
+
+static void count_round_trip(pk2aux_stats_entry *entry, unsigned long rtt) {
+	unsigned int bucket = 0;
+
+	while (bucket < PK2AUX_STATS_BUCKETS - 1 && (rtt >> (bucket + 1))) {
+		bucket++;
+	}
+
+	entry->rtt_total += rtt;
+	if (rtt > entry->rtt_max) {
+		entry->rtt_max = rtt;
+	}
+	entry->rtt_histogram[bucket]++;
+}
+
+
+
+static size_t command_length(const unsigned char *command, size_t length, int *answered) {
+	size_t needed = 1;
+
+	/* How much of the data the command at its start takes, and whether the device answers
+	 * it. Anything unrecognised is taken to run to the end. */
+	*answered = 0;
+	switch (command[0]) {
+		case FIRMWARE_VERSION:
+		case READ_STATUS:
+		case READ_VOLTAGES:
+		case UPLOAD_DATA:
+		case UPLOAD_DATA_NOLEN:
+			*answered = 1;
+			break;
+
+		case RD_INTERNAL_EE:
+			*answered = 1;
+			needed = 3;
+			break;
+
+		case SETVDD:
+		case SETVPP:
+			needed = 4;
+			break;
+
+		case ENTER_UART_MODE:
+			needed = 3;
+			break;
+
+		case EXECUTE_SCRIPT:
+		case DOWNLOAD_DATA:
+			needed = length > 1 ? 2 + (size_t) command[1] : 2;
+			break;
+
+		case WR_INTERNAL_EE:
+			needed = length > 2 ? 3 + (size_t) command[2] : 3;
+			break;
+
+		case NO_OPERATION:
+		case CLR_DOWNLOAD_BUFFER:
+		case CLR_UPLOAD_BUFFER:
+		case EXIT_UART_MODE:
+		case RESET:
+			break;
+
+		default:
+			needed = length;
+			break;
+	}
+
+	return needed < length ? needed : length;
+}
+
+
+
+static void count_write(pk2aux_stats_entry *entry, size_t length, int rc) {
+	entry->writes++;
+	if (rc >= 0) {
+		entry->bytes_written += length;
+	}
+}
+
+
+
+void pk2aux_stats_write(pk2aux_handle handle, const void *data, size_t length, int rc, unsigned long retries) {
+	const unsigned char *command = data;
+	struct pk2aux_expected *expected;
+	long long now = now_us();
+	size_t size;
+	int answered;
+
+	/* A failure is counted once, against the first command. */
+	count_result(&handle->stats.total, rc, retries);
+	count_result(&handle->stats.api[handle->api], rc, retries);
+	if (length) {
+		count_result(&handle->stats.opcode[command[0]], rc, retries);
+	}
+
+	/* Each command counts against its own opcode. Those the device answers are remembered
+	 * in order, so that each answer can be timed from its own command and attributed to it. */
+	while (length) {
+		size = command_length(command, length, &answered);
+		count_write(&handle->stats.total, size, rc);
+		count_write(&handle->stats.opcode[command[0]], size, rc);
+		count_write(&handle->stats.api[handle->api], size, rc);
+		if (answered && rc >= 0) {
+			/* Should the answers ever fall this far behind, the oldest are forgotten. */
+			if (handle->expected_count == PK2AUX_MAX_EXPECTED) {
+				handle->expected_first = (handle->expected_first + 1) % PK2AUX_MAX_EXPECTED;
+				handle->expected_count--;
+			}
+			expected = &handle->expected[(handle->expected_first + handle->expected_count++) % PK2AUX_MAX_EXPECTED];
+			expected->opcode = command[0];
+			expected->written = now;
+		}
+		command += size;
+		length -= size;
+	}
+}
+
+
+
+void pk2aux_stats_read(pk2aux_handle handle, long long submitted, int rc, unsigned long retries) {
+	pk2aux_stats_entry *entries[3];
+	struct pk2aux_expected expected = { 0, 0 };
+	int known = handle->expected_count != 0;
+	unsigned int i;
+
+	/* The answer belongs to the oldest command still waiting for one. An answer to a submitted
+	 * query is timed from when the query was submitted, which its entry in the pending ring
+	 * remembers. */
+	if (known) {
+		expected = handle->expected[handle->expected_first];
+		handle->expected_first = (handle->expected_first + 1) % PK2AUX_MAX_EXPECTED;
+		handle->expected_count--;
+	}
+	if (submitted) {
+		expected.written = submitted;
+		known = 1;
+	}
+
+	entries[0] = &handle->stats.total;
+	entries[1] = &handle->stats.opcode[expected.opcode];
+	entries[2] = &handle->stats.api[handle->api];
+	for (i = 0; i < 3; ++i) {
+		entries[i]->reads++;
+		if (rc >= 0) {
+			entries[i]->bytes_read += 64;
+			if (known) {
+				count_round_trip(entries[i], (unsigned long) (now_us() - expected.written));
+			}
+		}
+		count_result(entries[i], rc, retries);
+	}
+}
+
+
+
+static unsigned long percentile(const pk2aux_stats_entry *entry, unsigned long per_mille) {
+	unsigned long total = 0, seen = 0, wanted;
+	unsigned int i;
+
+	for (i = 0; i < PK2AUX_STATS_BUCKETS; ++i) {
+		total += entry->rtt_histogram[i];
+	}
+	if (!total) {
+		return 0;
+	}
+
+	/* Find the bucket holding the wanted sample and report the top of that bucket,
+	 * but never more than the longest time actually seen. */
+	wanted = (total * per_mille + 999) / 1000;
+	for (i = 0; i < PK2AUX_STATS_BUCKETS; ++i) {
+		seen += entry->rtt_histogram[i];
+		if (seen >= wanted) {
+			break;
+		}
+	}
+	return (2UL << i) - 1 < entry->rtt_max ? (2UL << i) - 1 : entry->rtt_max;
+}
+
+
+
+static void fill_percentiles(pk2aux_stats_entry *entry) {
+	entry->rtt_p50 = percentile(entry, 500);
+	entry->rtt_p99 = percentile(entry, 990);
+}
+
+
+
+void pk2aux_get_stats(pk2aux_handle handle, pk2aux_stats *stats) {
+	unsigned int i;
+
+	pthread_mutex_lock(&handle->lock);
+	*stats = handle->stats;
+	pthread_mutex_unlock(&handle->lock);
+
+	fill_percentiles(&stats->total);
+	for (i = 0; i < 256; ++i) {
+		fill_percentiles(&stats->opcode[i]);
+	}
+	for (i = 0; i < PK2AUX_API_COUNT; ++i) {
+		fill_percentiles(&stats->api[i]);
+	}
+}
+
+
+
+void pk2aux_reset_stats(pk2aux_handle handle) {
+	pthread_mutex_lock(&handle->lock);
+	memset(&handle->stats, 0, sizeof(handle->stats));
+	pthread_mutex_unlock(&handle->lock);
+}
+
+
+
+static void dump_entry(FILE *stream, const char *kind, const char *name, const pk2aux_stats_entry *entry) {
+	unsigned long round_trips = 0;
+	unsigned int i;
+
+	for (i = 0; i < PK2AUX_STATS_BUCKETS; ++i) {
+		round_trips += entry->rtt_histogram[i];
+	}
+
+	fprintf(stream, "%-6s %-19s %8lu %8lu %10llu %10llu %8lu %7lu %6lu %8llu %8lu %8lu %8lu\n",
+			kind, name, entry->writes, entry->reads, entry->bytes_written, entry->bytes_read,
+			entry->timeouts, entry->retries, entry->errors,
+			round_trips ? entry->rtt_total / round_trips : 0ULL, entry->rtt_p50, entry->rtt_p99, entry->rtt_max);
+}
+
+
+
+void pk2aux_dump_stats(pk2aux_handle handle, FILE *stream) {
+	pk2aux_stats *stats;
+	const char *name;
+	char buffer[8];
+	unsigned int i;
+
+	/* The structure is too big to want on the stack. */
+	stats = malloc(sizeof(*stats));
+	if (!stats) {
+		return;
+	}
+	pk2aux_get_stats(handle, stats);
+
+	fprintf(stream, "Statistics for %u:%u (round trip times in microseconds)\n", handle->bus_number, handle->device_address);
+	fprintf(stream, "%-6s %-19s %8s %8s %10s %10s %8s %7s %6s %8s %8s %8s %8s\n",
+			"", "", "writes", "reads", "bytes out", "bytes in", "timeouts", "retries", "errors", "mean", "p50", "p99", "max");
+	dump_entry(stream, "total", "", &stats->total);
+	for (i = 0; i < 256; ++i) {
+		if (stats->opcode[i].writes || stats->opcode[i].reads) {
+			if (!(name = OPCODE_NAMES[i])) {
+				sprintf(buffer, "0x%02X", i);
+				name = buffer;
+			}
+			dump_entry(stream, "opcode", name, &stats->opcode[i]);
+		}
+	}
+	for (i = 0; i < PK2AUX_API_COUNT; ++i) {
+		if (stats->api[i].writes || stats->api[i].reads) {
+			dump_entry(stream, "api", API_NAMES[i], &stats->api[i]);
+		}
+	}
+	if (stats->uart_bytes_received) {
+		fprintf(stream, "UART: %llu bytes received, %lu suspected overruns\n", stats->uart_bytes_received, stats->uart_overruns);
+	}
+
+	free(stats);
+}
+
+
+
+const char *pk2aux_api_name(enum PK2AUX_API api) {
+	if ((unsigned int) api >= PK2AUX_API_COUNT) {
+		return "unknown";
+	}
+
+	return API_NAMES[api];
+}
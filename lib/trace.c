@@ -0,0 +1,123 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cmd.h"
+#include "internal.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+
+
+/* A packet trace is a 12-byte header, "PK2TRACE" and a little-endian format version,
+ * followed by one fixed-size record per packet or session event, in the order they
+ * happened. See PK2AUX_TRACE_RECORD_SIZE for the record layout. */
+
+static const unsigned char TRACE_HEADER[12] = { 'P', 'K', '2', 'T', 'R', 'A', 'C', 'E', 1, 0, 0, 0 };
+
+/* One trace is shared by every context and every thread. */
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file = 0;
+
+
+
+static void put_le(unsigned char *p, unsigned long long value, unsigned int bytes) {
+	unsigned int i;
+
+	for (i = 0; i < bytes; ++i) {
+		p[i] = (unsigned char) (value >> (8 * i));
+	}
+}
+
+
+
+int pk2aux_trace_start(const char *path) {
+	FILE *fp;
+
+	if (!(fp = fopen(path, "wb"))) {
+		return LIBUSB_ERROR_ACCESS;
+	}
+	if (fwrite(TRACE_HEADER, sizeof(TRACE_HEADER), 1, fp) != 1) {
+		fclose(fp);
+		return LIBUSB_ERROR_IO;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		pthread_mutex_unlock(&trace_lock);
+		fclose(fp);
+		return LIBUSB_ERROR_BUSY;
+	}
+	trace_file = fp;
+	pthread_mutex_unlock(&trace_lock);
+
+	return 0;
+}
+
+
+
+void pk2aux_trace_stop(void) {
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fclose(trace_file);
+		trace_file = 0;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+
+
+void pk2aux_trace_record(const struct pk2aux_engine *engine, unsigned int type, int status, const void *data, size_t length) {
+	unsigned char record[PK2AUX_TRACE_RECORD_SIZE];
+	struct timespec now;
+
+	/* Not tracing is the common case, and cheap to notice; it is checked again under the lock. */
+	if (!trace_file) {
+		return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	put_le(record, now.tv_sec * 1000000000ULL + now.tv_nsec, 8);
+	record[8] = (unsigned char) type;
+	record[9] = engine->bus_number;
+	record[10] = engine->device_address;
+	record[11] = 0;
+	put_le(record + 12, (unsigned int) status, 4);
+
+	/* OUT packets are recorded as they go over the wire, padded out as the transports
+	 * pad them. */
+	memset(record + 16, type == PK2AUX_TRACE_OUT ? END_OF_BUFFER : 0, 64);
+	if (length > 64) {
+		length = 64;
+	}
+	if (length) {
+		memcpy(record + 16, data, length);
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fwrite(record, sizeof(record), 1, trace_file);
+
+		/* Push each session out to disk as it ends, so a crash loses as little as possible. */
+		if (type == PK2AUX_TRACE_CLOSE) {
+			fflush(trace_file);
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
@@ -19,17 +19,178 @@
 #include "cmd.h"
 #include "internal.h"
 #include <assert.h>
+#include <errno.h>
 #include <math.h>
+#include <sched.h>
+#include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 
+/* The firmware's download buffer, which feeds the UART, and its upload buffer, which the
+ * UART fills. */
+#define DEVICE_BUFFER 256
+#define DEVICE_UPLOAD 128
 
+/* Each character takes ten bit times. Nothing tells the host how far the device has got,
+ * so the model of its buffer assumes a little more, so as to never get ahead of it. */
+#define BIT_TIMES 10.2
 
-int pk2aux_start_uart(pk2aux_handle handle, unsigned int baud) {
+/* How long data can take to reach the device, in microseconds: a frame for each packet that
+ * may be queued ahead of it, one for itself, and part of one before the first. An idle
+ * transmitter only starts once it arrives. */
+#define TX_LATENCY ((PK2AUX_NUM_TRANSFERS + 1) * 1000)
+
+
+
+static long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+
+static double tx_level(pk2aux_handle handle, long long now) {
+	double level;
+
+	/* How much of what was sent is still waiting in the device's buffer. Nothing drains
+	 * before the time the model starts from, which may be in the future. */
+	if (now <= handle->uart_tx_time) {
+		return handle->uart_tx_level;
+	}
+	level = handle->uart_tx_level - (now - handle->uart_tx_time) * handle->uart_baud / (BIT_TIMES * 1.0e6);
+	return level > 0.0 ? level : 0.0;
+}
+
+
+
+static long long tx_wait(pk2aux_handle handle, size_t length, long long now) {
+	double excess = tx_level(handle, now) + length - DEVICE_BUFFER;
+
+	/* How long until the device has room for this much more. */
+	return excess > 0.0 ? (long long) ceil(excess * BIT_TIMES * 1.0e6 / handle->uart_baud) : 0;
+}
+
+
+
+static int sleep_for(pk2aux_handle handle, long long wait) {
+	struct timespec until;
+	long long when = now_us() + wait, deadline;
+	int rc = 0;
+
+	/* The wait never extends past the deadline. */
+	if (handle->engine.has_deadline) {
+		deadline = handle->engine.deadline.tv_sec * 1000000LL + handle->engine.deadline.tv_nsec / 1000;
+		if (deadline < when) {
+			when = deadline;
+			rc = LIBUSB_ERROR_TIMEOUT;
+		}
+	}
+
+	until.tv_sec = when / 1000000LL;
+	until.tv_nsec = (when % 1000000LL) * 1000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &until, 0) == EINTR);
+	return rc;
+}
+
+
+
+static void note_sent(pk2aux_handle handle, size_t length, long long now) {
+	/* Add data handed to the device to the model of its buffer. If the device could have run
+	 * out (draining at its fastest), its transmitter may sit idle until the new data arrives,
+	 * so the model doesn't drain again until then. */
+	if (now < handle->uart_tx_time) {
+		handle->uart_tx_level += length;
+	} else if (handle->uart_tx_level - (now - handle->uart_tx_time) * handle->uart_baud / 10.0e6 > 0.0) {
+		handle->uart_tx_level = tx_level(handle, now) + length;
+		handle->uart_tx_time = now;
+	} else {
+		handle->uart_tx_level = tx_level(handle, now) + length;
+		handle->uart_tx_time = now + TX_LATENCY;
+	}
+}
+
+
+
+static int send_paced(pk2aux_handle handle, const unsigned char *data, size_t length, size_t *sent, int wait) {
+	unsigned char *buffer;
+	size_t to_send;
+	struct timeval tv;
+	long long now, delay;
+	int rc;
+
+	*sent = 0;
+	while (*sent < length) {
+		/* Don't start another block once the deadline has passed. */
+		if (handle->engine.has_deadline && !pk2aux_engine_time_left(&handle->engine, &tv)) {
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+
+		/* Up to 62 bytes fit in a single USB transaction. Only send once the device has
+		 * room for all of them, rather than spend a transaction on a few. */
+		to_send = length - *sent > 62 ? 62 : length - *sent;
+		now = now_us();
+		if ((delay = tx_wait(handle, to_send, now)) > 0) {
+			if (!wait) {
+				return 0;
+			}
+			if ((rc = sleep_for(handle, delay)) < 0) {
+				return rc;
+			}
+			continue;
+		}
+
+		/* The data goes straight into the packet, with no copy in between. */
+		if ((rc = pk2aux_reserve(handle, to_send + 2, &buffer)) < 0) {
+			return rc;
+		}
+		buffer[0] = DOWNLOAD_DATA;
+		buffer[1] = (unsigned char) to_send;
+		memcpy(buffer + 2, data + *sent, to_send);
+		if ((rc = pk2aux_submit_reserved(handle, to_send + 2)) < 0) {
+			return rc;
+		}
+
+		note_sent(handle, to_send, now);
+		*sent += to_send;
+	}
+
+	return 0;
+}
+
+
+
+static int pump_tx(pk2aux_handle handle, int wait) {
+	size_t contiguous, sent;
+	int rc;
+
+	/* Hand as much of the ring over as the device has room for, waiting for the rest if asked to. */
+	while (handle->uart_tx_used) {
+		contiguous = PK2AUX_UART_TX_SIZE - handle->uart_tx_head;
+		if (contiguous > handle->uart_tx_used) {
+			contiguous = handle->uart_tx_used;
+		}
+		rc = send_paced(handle, handle->uart_tx + handle->uart_tx_head, contiguous, &sent, wait);
+		handle->uart_tx_head = (handle->uart_tx_head + sent) % PK2AUX_UART_TX_SIZE;
+		handle->uart_tx_used -= sent;
+		if (rc < 0 || sent < contiguous) {
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static int start_uart(pk2aux_handle handle, unsigned int baud) {
 	int rc;
 	unsigned int brg;
 	unsigned char buffer[3];
 
+	handle->api = PK2AUX_API_START_UART;
+
 	/* Check that the UART isn't already enabled. */
 	if (handle->uart_enabled) {
 		return LIBUSB_ERROR_BUSY;
@@ -51,23 +212,57 @@ int pk2aux_start_uart(pk2aux_handle handle, unsigned int baud) {
 		return rc;
 	}
 
+	/* The UART takes over PGC and PGD, so whatever modes they had are gone. */
+	handle->shadow.known &= ~(PK2AUX_PIN_PGC | PK2AUX_PIN_PGD);
+
 	handle->uart_enabled = 1;
 	handle->uart_baud = baud;
-	handle->uart_buffer_used = 0;
+	handle->uart_rx_head = handle->uart_rx_used = 0;
+	handle->uart_requested = 0;
+	handle->uart_asked = now_us();
+	handle->uart_pump_error = 0;
+	handle->uart_tx_head = handle->uart_tx_used = 0;
+	handle->uart_tx_level = 0.0;
+	handle->uart_tx_time = now_us();
 
 	return 0;
 }
 
 
 
-int pk2aux_stop_uart(pk2aux_handle handle) {
+int pk2aux_start_uart(pk2aux_handle handle, unsigned int baud) {
 	int rc;
-	unsigned char buffer[2];
+
+	pthread_mutex_lock(&handle->lock);
+	rc = start_uart(handle, baud);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int stop_uart(pk2aux_handle handle) {
+	int rc;
+	unsigned char buffer[64];
+
+	handle->api = PK2AUX_API_STOP_UART;
 
 	if (!handle->uart_enabled) {
 		return 0;
 	}
 
+	/* Let everything queued go out before the UART is switched off. */
+	if ((rc = pump_tx(handle, 1)) < 0 || (rc = sleep_for(handle, tx_wait(handle, DEVICE_BUFFER, now_us()))) < 0) {
+		return rc;
+	}
+
+	/* An answer still on its way is let in, so that it's out of the way. */
+	while (handle->uart_requested) {
+		if ((rc = pk2aux_read_pending(handle)) < 0) {
+			return rc;
+		}
+	}
+
 	buffer[0] = EXIT_UART_MODE;
 	buffer[1] = CLR_UPLOAD_BUFFER;
 	if ((rc = pk2aux_write(handle, buffer, 2)) < 0) {
@@ -81,9 +276,144 @@ int pk2aux_stop_uart(pk2aux_handle handle) {
 
 
 
-int pk2aux_receive_uart(pk2aux_handle handle, void *data, size_t *length) {
+int pk2aux_stop_uart(pk2aux_handle handle) {
+	int rc;
+
+	pk2aux_stop_uart_pump(handle);
+
+	pthread_mutex_lock(&handle->lock);
+	rc = stop_uart(handle);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static void note_asked(pk2aux_handle handle, long long now) {
+	handle->uart_gap = now - handle->uart_asked;
+	handle->uart_asked = now;
+}
+
+
+
+static int ask_uart(pk2aux_handle handle, int later) {
+	static const unsigned char UPLOAD_COMMAND[] = { UPLOAD_DATA };
+	long long now = now_us();
 	int rc;
+
+	/* An answer that isn't read straight away goes through the pending ring, so that whatever
+	 * reads next puts it in the receive ring rather than taking it for its own. */
+	if (later) {
+		rc = pk2aux_submit_pending(handle, 0, UPLOAD_COMMAND, sizeof(UPLOAD_COMMAND), 0);
+	} else {
+		rc = pk2aux_write(handle, UPLOAD_COMMAND, sizeof(UPLOAD_COMMAND));
+	}
+	if (rc < 0) {
+		return rc;
+	}
+
+	note_asked(handle, now);
+	handle->uart_requested = later;
+	return 0;
+}
+
+
+
+static size_t store_uart(pk2aux_handle handle, const unsigned char *answer) {
+	size_t count, tail, first;
+
+	/* Whatever doesn't fit in the ring (which could only happen if it has shrunk since the
+	 * block was asked for) is lost. */
+	count = answer[0] > 63 ? 63 : answer[0];
+	if (count > handle->uart_rx_size - handle->uart_rx_used) {
+		count = handle->uart_rx_size - handle->uart_rx_used;
+	}
+	tail = (handle->uart_rx_head + handle->uart_rx_used) & (handle->uart_rx_size - 1);
+	first = handle->uart_rx_size - tail < count ? handle->uart_rx_size - tail : count;
+	memcpy(handle->uart_rx + tail, answer + 1, first);
+	memcpy(handle->uart_rx, answer + 1 + first, count - first);
+	handle->uart_rx_used += count;
+	handle->stats.uart_bytes_received += count;
+
+	/* The device drops what its upload buffer can't hold, and says nothing. If it had time
+	 * to fill its buffer since it was last asked, and it has more than a block to give, some
+	 * is likely to have been lost. */
+	if (answer[0] >= 63 && handle->uart_gap > DEVICE_UPLOAD * 10.0e6 / handle->uart_baud) {
+		handle->stats.uart_overruns++;
+	}
+	return count;
+}
+
+
+
+void pk2aux_uart_arrived(pk2aux_handle handle, const unsigned char *answer) {
+	handle->uart_requested = 0;
+	if (answer) {
+		store_uart(handle, answer);
+	}
+}
+
+
+
+static int read_uart(pk2aux_handle handle, size_t *count) {
 	unsigned char buffer[64];
+	int rc;
+
+	if ((rc = pk2aux_read(handle, buffer)) < 0) {
+		return rc;
+	}
+
+	*count = store_uart(handle, buffer);
+	return 0;
+}
+
+
+
+static int fetch_uart(pk2aux_handle handle, size_t *count) {
+	size_t used = handle->uart_rx_used;
+	int rc;
+
+	/* A block already asked for arrives through the pending ring. Otherwise ask for one and
+	 * wait for it. The caller makes sure the ring has room for a whole one. */
+	if (handle->uart_requested) {
+		while (handle->uart_requested) {
+			if ((rc = pk2aux_read_pending(handle)) < 0) {
+				return rc;
+			}
+		}
+		*count = handle->uart_rx_used - used;
+		return 0;
+	}
+
+	if ((rc = ask_uart(handle, 0)) < 0) {
+		return rc;
+	}
+	return read_uart(handle, count);
+}
+
+
+
+static void take_uart(pk2aux_handle handle, void *data, size_t *length) {
+	size_t first;
+
+	/* Copy what we can into the application's buffer, in up to two pieces either side of the wrap. */
+	if (*length > handle->uart_rx_used) {
+		*length = handle->uart_rx_used;
+	}
+	first = handle->uart_rx_size - handle->uart_rx_head < *length ? handle->uart_rx_size - handle->uart_rx_head : *length;
+	memcpy(data, handle->uart_rx + handle->uart_rx_head, first);
+	memcpy((unsigned char *) data + first, handle->uart_rx, *length - first);
+	handle->uart_rx_head = (handle->uart_rx_head + *length) & (handle->uart_rx_size - 1);
+	handle->uart_rx_used -= *length;
+}
+
+
+
+static int receive_uart(pk2aux_handle handle, void *data, size_t *length) {
+	size_t count;
+	int rc;
+
+	handle->api = PK2AUX_API_RECEIVE_UART;
 
 	/* If we're not in UART mode, we have no data to present. */
 	if (!handle->uart_enabled) {
@@ -91,88 +421,457 @@ int pk2aux_receive_uart(pk2aux_handle handle, void *data, size_t *length) {
 		return 0;
 	}
 
-	/* If we have any data buffered, present it first (the buffer must be 100% empty
-	 * before we can request another block from the device). */
-	if (handle->uart_buffer_used) {
-		if (handle->uart_buffer_used < *length) {
-			*length = handle->uart_buffer_used;
-		}
-		memcpy(data, handle->uart_buffer, *length);
-		memmove(data, data + *length, handle->uart_buffer_used - *length);
-		handle->uart_buffer_used -= *length;
-		return 0;
+	/* Keep queued data flowing while receiving. */
+	if ((rc = pump_tx(handle, 0)) < 0) {
+		return rc;
 	}
 
-	/* Receive some data. */
-	buffer[0] = UPLOAD_DATA;
-	if ((rc = pk2aux_write(handle, buffer, 1)) < 0) {
+	/* A receive pump that failed passes its error on once what it did receive is used up. */
+	if (!handle->uart_rx_used && handle->uart_pump_error) {
+		rc = handle->uart_pump_error;
+		handle->uart_pump_error = 0;
+		*length = 0;
 		return rc;
 	}
 
-	if ((rc = pk2aux_read(handle, buffer)) < 0) {
+	/* Data already in the ring is presented without asking the device for more. Otherwise
+	 * fetch a block, and go on fetching for as long as the blocks come back full (so more
+	 * is likely waiting), the caller wants more and the ring has room. */
+	if (!handle->uart_rx_used) {
+		do {
+			if ((rc = fetch_uart(handle, &count)) < 0) {
+				return rc;
+			}
+		} while (count == 63 && handle->uart_rx_used < *length && handle->uart_rx_size - handle->uart_rx_used >= 63);
+	}
+
+	take_uart(handle, data, length);
+	return 0;
+}
+
+
+
+int pk2aux_receive_uart(pk2aux_handle handle, void *data, size_t *length) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = receive_uart(handle, data, length);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int request_uart(pk2aux_handle handle) {
+	int rc;
+
+	handle->api = PK2AUX_API_REQUEST_UART;
+
+	if (!handle->uart_enabled) {
+		return 0;
+	}
+
+	/* Keep queued data flowing while waiting for received data. */
+	if ((rc = pump_tx(handle, 0)) < 0) {
 		return rc;
 	}
 
-	/* Copy what we can into the application's buffer. */
-	if (*length > buffer[0]) {
-		*length = buffer[0];
+	/* Only one block can be asked for at a time, and only if the rings have room for it. */
+	if (handle->uart_requested || handle->uart_rx_size - handle->uart_rx_used < 63 || handle->pending_count == PK2AUX_MAX_PENDING) {
+		return 0;
 	}
-	memcpy(data, buffer + 1, *length);
 
-	/* Copy the rest into the buffer in the handle. */
-	handle->uart_buffer_used = buffer[0] - *length;
-	memcpy(handle->uart_buffer, buffer + 1 + *length, handle->uart_buffer_used);
+	return ask_uart(handle, 1);
+}
 
-	return 0;
+
+
+int pk2aux_request_uart(pk2aux_handle handle) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = request_uart(handle);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
 }
 
 
 
-int pk2aux_send_uart(pk2aux_handle handle, const void *data, size_t length) {
+static int uart_ready(pk2aux_handle handle) {
+	if (!handle->uart_enabled || handle->uart_rx_used) {
+		return 1;
+	}
+
+	return handle->uart_requested && pk2aux_engine_ready(&handle->engine);
+}
+
+
+
+int pk2aux_uart_ready(pk2aux_handle handle) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = uart_ready(handle);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int send_uart(pk2aux_handle handle, const void *data, size_t *length) {
+	size_t sent = 0;
 	int rc;
-	unsigned char buffer[64];
-	size_t to_send;
-	unsigned int to_sleep_total, to_sleep_this;
 
 	/* If we're not in UART mode, fail. */
 	if (!handle->uart_enabled) {
+		*length = 0;
 		return LIBUSB_ERROR_PIPE;
 	}
 
-	/* Keep going as long as there's data left. */
-	while (length) {
-		/* Try to send up to 62 bytes (that's all that fits in a single USB transaction). */
-		if (length > 62) {
-			to_send = 62;
-		} else {
-			to_send = length;
+	/* Whatever was queued earlier goes first. */
+	if ((rc = pump_tx(handle, 1)) == 0) {
+		rc = send_paced(handle, data, *length, &sent, 1);
+	}
+
+	*length = sent;
+	return rc;
+}
+
+
+
+int pk2aux_send_uart(pk2aux_handle handle, const void *data, size_t length) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	handle->api = PK2AUX_API_SEND_UART;
+	rc = send_uart(handle, data, &length);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+int pk2aux_send_uart_until(pk2aux_handle handle, const void *data, size_t *length, const struct timespec *deadline) {
+	struct timespec saved_deadline;
+	int saved_has_deadline, rc;
+
+	pthread_mutex_lock(&handle->lock);
+	handle->api = PK2AUX_API_SEND_UART;
+
+	saved_has_deadline = handle->engine.has_deadline;
+	saved_deadline = handle->engine.deadline;
+	pk2aux_set_deadline(handle, deadline);
+
+	rc = send_uart(handle, data, length);
+
+	handle->engine.has_deadline = saved_has_deadline;
+	handle->engine.deadline = saved_deadline;
+
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int exchange_uart(pk2aux_handle handle, const void *tx, size_t *tx_length, void *rx, size_t *rx_length) {
+	unsigned char *buffer;
+	size_t to_send, length, count;
+	long long now, delay;
+	int ask, rc = 0;
+
+	handle->api = PK2AUX_API_EXCHANGE_UART;
+	to_send = *tx_length > 61 ? 61 : *tx_length;
+	*tx_length = 0;
+
+	if (!handle->uart_enabled) {
+		*rx_length = 0;
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	/* Whatever was queued earlier goes first, and the device needs room for the new data. */
+	if ((rc = pump_tx(handle, 1)) < 0) {
+		*rx_length = 0;
+		return rc;
+	}
+	while (to_send && (delay = tx_wait(handle, to_send, now_us())) > 0) {
+		if ((rc = sleep_for(handle, delay)) < 0) {
+			*rx_length = 0;
+			return rc;
 		}
+	}
 
-		buffer[0] = DOWNLOAD_DATA;
-		buffer[1] = (unsigned char) to_send;
-		memcpy(buffer + 2, data, to_send);
-		if ((rc = pk2aux_write(handle, buffer, to_send + 2)) < 0) {
+	/* The data and the question share one packet, so both go in one transaction: up to 61
+	 * bytes leave room for the question after them. The question is left out if one is
+	 * already outstanding or the ring has no room for the answer. */
+	ask = !handle->uart_requested && handle->uart_rx_size - handle->uart_rx_used >= 63;
+	length = (to_send ? to_send + 2 : 0) + (ask ? 1 : 0);
+	if (length) {
+		if ((rc = pk2aux_reserve(handle, length, &buffer)) < 0) {
+			*rx_length = 0;
 			return rc;
 		}
+		if (to_send) {
+			buffer[0] = DOWNLOAD_DATA;
+			buffer[1] = (unsigned char) to_send;
+			memcpy(buffer + 2, tx, to_send);
+		}
+		if (ask) {
+			buffer[length - 1] = UPLOAD_DATA;
+		}
+		if ((rc = pk2aux_submit_reserved(handle, length)) < 0) {
+			*rx_length = 0;
+			return rc;
+		}
+
+		now = now_us();
+		if (to_send) {
+			note_sent(handle, to_send, now);
+			*tx_length = to_send;
+		}
+		if (ask) {
+			note_asked(handle, now);
+		}
+	}
+
+	/* Collect the answer, or the one asked for earlier, and hand over what has been received. */
+	if (ask) {
+		rc = read_uart(handle, &count);
+	} else if (handle->uart_requested) {
+		rc = fetch_uart(handle, &count);
+	}
+	if (rc < 0) {
+		*rx_length = 0;
+		return rc;
+	}
+	take_uart(handle, rx, rx_length);
+	return 0;
+}
+
+
 
-		/* Sleep for the appropriate amount of time to allow the data to drain (we don't want
-		 * to overflow the download buffer, and there's no way to query how much data is in it). */
-		to_sleep_total = 1000U * to_send * 11U / handle->uart_baud;
-		while (to_sleep_total) {
-			if (to_sleep_total > 1000U) {
-				to_sleep_this = 1000000U;
-			} else {
-				to_sleep_this = to_sleep_total * 1000U;
+int pk2aux_exchange_uart(pk2aux_handle handle, const void *tx, size_t *tx_length, void *rx, size_t *rx_length) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = exchange_uart(handle, tx, tx_length, rx, rx_length);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static int queue_uart(pk2aux_handle handle, const void *data, size_t *length) {
+	size_t tail, first;
+
+	handle->api = PK2AUX_API_QUEUE_UART;
+
+	if (!handle->uart_enabled) {
+		*length = 0;
+		return LIBUSB_ERROR_PIPE;
+	}
+
+	/* Take as much as fits in the ring, in up to two pieces either side of the wrap. */
+	if (*length > PK2AUX_UART_TX_SIZE - handle->uart_tx_used) {
+		*length = PK2AUX_UART_TX_SIZE - handle->uart_tx_used;
+	}
+	tail = (handle->uart_tx_head + handle->uart_tx_used) % PK2AUX_UART_TX_SIZE;
+	first = PK2AUX_UART_TX_SIZE - tail < *length ? PK2AUX_UART_TX_SIZE - tail : *length;
+	memcpy(handle->uart_tx + tail, data, first);
+	memcpy(handle->uart_tx, (const unsigned char *) data + first, *length - first);
+	handle->uart_tx_used += *length;
+
+	return pump_tx(handle, 0);
+}
+
+
+
+int pk2aux_queue_uart(pk2aux_handle handle, const void *data, size_t *length) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = queue_uart(handle, data, length);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+int pk2aux_pump_uart(pk2aux_handle handle) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	handle->api = PK2AUX_API_PUMP_UART;
+	rc = handle->uart_enabled ? pump_tx(handle, 0) : 0;
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+int pk2aux_flush_uart(pk2aux_handle handle) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	handle->api = PK2AUX_API_FLUSH_UART;
+	rc = handle->uart_enabled ? pump_tx(handle, 1) : 0;
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+size_t pk2aux_uart_queued(pk2aux_handle handle, struct timeval *tv) {
+	long long wait;
+	size_t queued;
+
+	pthread_mutex_lock(&handle->lock);
+	queued = handle->uart_tx_used;
+	if (queued && tv) {
+		wait = tx_wait(handle, queued > 62 ? 62 : queued, now_us());
+		tv->tv_sec = (time_t) (wait / 1000000LL);
+		tv->tv_usec = (suseconds_t) (wait % 1000000LL);
+	}
+	pthread_mutex_unlock(&handle->lock);
+	return queued;
+}
+
+
+
+static int set_uart_buffer_size(pk2aux_handle handle, size_t size) {
+	unsigned char *ring;
+	size_t first;
+
+	/* A power of two lets positions wrap with a mask, and the ring has to hold at least a block. */
+	if (size < 64 || (size & (size - 1)) || size < handle->uart_rx_used) {
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	ring = malloc(size);
+	if (!ring) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* Keep whatever is buffered, moved to the start of the new ring. */
+	first = handle->uart_rx_size - handle->uart_rx_head < handle->uart_rx_used ? handle->uart_rx_size - handle->uart_rx_head : handle->uart_rx_used;
+	memcpy(ring, handle->uart_rx + handle->uart_rx_head, first);
+	memcpy(ring + first, handle->uart_rx, handle->uart_rx_used - first);
+	free(handle->uart_rx);
+	handle->uart_rx = ring;
+	handle->uart_rx_size = size;
+	handle->uart_rx_head = 0;
+
+	return 0;
+}
+
+
+
+int pk2aux_set_uart_buffer_size(pk2aux_handle handle, size_t size) {
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	rc = set_uart_buffer_size(handle, size);
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+static void *uart_pump(void *arg) {
+	pk2aux_handle handle = arg;
+	struct timespec until;
+	size_t count;
+	long long wait, tx;
+	int rc;
+
+	pthread_mutex_lock(&handle->lock);
+	while (!handle->uart_pump_stop) {
+		/* Fetch a block whenever the ring has room for one, and keep queued data flowing. */
+		count = 0;
+		rc = 0;
+		if (handle->uart_enabled) {
+			handle->api = PK2AUX_API_UART_PUMP;
+			if ((rc = pump_tx(handle, 0)) == 0 && handle->uart_rx_size - handle->uart_rx_used >= 63) {
+				rc = fetch_uart(handle, &count);
 			}
-			usleep(to_sleep_this);
-			to_sleep_total -= to_sleep_this / 1000U;
+		}
+		if (rc < 0) {
+			handle->uart_pump_error = rc;
+			break;
 		}
 
-		/* Consume the data. */
-		data = ((char *) data) + to_send;
-		length -= to_send;
+		/* A full block means more is probably waiting, so go straight back for it, but give
+		 * other threads a look in. Otherwise wait about as long as half a block takes to come
+		 * in, which leaves plenty of time before the device's buffer fills. */
+		if (count == 63) {
+			pthread_mutex_unlock(&handle->lock);
+			sched_yield();
+			pthread_mutex_lock(&handle->lock);
+			continue;
+		}
+		wait = handle->uart_enabled ? (long long) (31 * 10.0e6 / handle->uart_baud) : 10000;
+		if (wait < 1000) {
+			wait = 1000;
+		}
+		if (handle->uart_enabled && handle->uart_tx_used && (tx = tx_wait(handle, handle->uart_tx_used > 62 ? 62 : handle->uart_tx_used, now_us())) < wait) {
+			wait = tx;
+		}
+		wait += now_us();
+		until.tv_sec = wait / 1000000LL;
+		until.tv_nsec = (wait % 1000000LL) * 1000;
+		pthread_cond_timedwait(&handle->uart_pump_wake, &handle->lock, &until);
 	}
 
+	/* Whether stopped or failed, the thread is done once it lets go of the lock. */
+	handle->uart_pump_exited = 1;
+	pthread_mutex_unlock(&handle->lock);
+
 	return 0;
 }
 
+
+
+int pk2aux_start_uart_pump(pk2aux_handle handle) {
+	int rc = 0;
+
+	pthread_mutex_lock(&handle->lock);
+
+	/* A pump that gave up after an error is still running as far as the handle knows. It
+	 * has already let go of the lock for good, so it can be joined while holding it. */
+	if (handle->uart_pump_running && handle->uart_pump_exited) {
+		pthread_join(handle->uart_pump, 0);
+		handle->uart_pump_running = 0;
+	}
+
+	if (!handle->uart_pump_running) {
+		handle->uart_pump_stop = 0;
+		handle->uart_pump_exited = 0;
+		handle->uart_pump_error = 0;
+		if (pthread_create(&handle->uart_pump, 0, &uart_pump, handle) != 0) {
+			rc = LIBUSB_ERROR_NO_MEM;
+		} else {
+			handle->uart_pump_running = 1;
+		}
+	}
+	pthread_mutex_unlock(&handle->lock);
+	return rc;
+}
+
+
+
+void pk2aux_stop_uart_pump(pk2aux_handle handle) {
+	pthread_mutex_lock(&handle->lock);
+	if (!handle->uart_pump_running) {
+		pthread_mutex_unlock(&handle->lock);
+		return;
+	}
+	handle->uart_pump_stop = 1;
+	pthread_cond_signal(&handle->uart_pump_wake);
+	pthread_mutex_unlock(&handle->lock);
+
+	/* The pump needs the lock to finish, so it can't be held while waiting for it. */
+	pthread_join(handle->uart_pump, 0);
+
+	pthread_mutex_lock(&handle->lock);
+	handle->uart_pump_running = 0;
+	pthread_mutex_unlock(&handle->lock);
+}
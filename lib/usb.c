@@ -0,0 +1,464 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cmd.h"
+#include "internal.h"
+#include <string.h>
+
+/* libusb 1.0.21 and later can provide buffers the controller can transfer to and from
+ * directly, which spares the kernel a copy of every packet. */
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define HAVE_DEV_MEM 1
+#endif
+
+#define DEV_MEM_SIZE (2 * PK2AUX_NUM_TRANSFERS * 64)
+
+
+
+static int translate_status(enum libusb_transfer_status status) {
+	switch (status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return 0;
+
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return LIBUSB_ERROR_TIMEOUT;
+
+		case LIBUSB_TRANSFER_CANCELLED:
+			return LIBUSB_ERROR_INTERRUPTED;
+
+		case LIBUSB_TRANSFER_STALL:
+			return LIBUSB_ERROR_PIPE;
+
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return LIBUSB_ERROR_NO_DEVICE;
+
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return LIBUSB_ERROR_OVERFLOW;
+
+		default:
+			return LIBUSB_ERROR_IO;
+	}
+}
+
+
+
+static void LIBUSB_CALL transfer_callback(struct libusb_transfer *transfer) {
+	struct pk2aux_transfer *slot = transfer->user_data;
+
+	slot->status = translate_status(transfer->status);
+	slot->completed = 1;
+}
+
+
+
+static int wait_transfer(struct pk2aux_engine *engine, struct pk2aux_transfer *slot) {
+	struct timeval tv;
+	int rc, cancelled = 0;
+
+	/* Drive the libusb event loop until this particular transfer has completed.
+	 * Completions of other transfers (on this or any other engine sharing the
+	 * context) are recorded by their callbacks as a side effect. */
+	while (!slot->completed) {
+		if (engine->has_deadline && !cancelled) {
+			if (!pk2aux_engine_time_left(engine, &tv)) {
+				/* Out of time. The transfer is abandoned, but it still has to be
+				 * waited for since libusb owns it until its callback runs. */
+				libusb_cancel_transfer(slot->transfer);
+				cancelled = 1;
+				continue;
+			}
+			rc = libusb_handle_events_timeout_completed(engine->usb_context, &tv, &slot->completed);
+		} else {
+			rc = libusb_handle_events_completed(engine->usb_context, &slot->completed);
+		}
+		if (rc == LIBUSB_ERROR_INTERRUPTED) {
+			engine->retries++;
+		} else if (rc < 0) {
+			return rc;
+		}
+	}
+
+	slot->pending = 0;
+	if (cancelled && slot->status == LIBUSB_ERROR_INTERRUPTED) {
+		return LIBUSB_ERROR_TIMEOUT;
+	}
+	return slot->status;
+}
+
+
+
+static int submit_transfer(struct pk2aux_engine *engine, struct pk2aux_transfer *slot) {
+	struct timeval tv;
+	unsigned int timeout = engine->timeout;
+	int rc;
+
+	/* A transfer may not outlive the deadline, if there is one. */
+	if (engine->has_deadline) {
+		if (!pk2aux_engine_time_left(engine, &tv)) {
+			return LIBUSB_ERROR_TIMEOUT;
+		}
+		if (!timeout || tv.tv_sec < (long) (timeout / 1000U) || (tv.tv_sec == (long) (timeout / 1000U) && (unsigned long) tv.tv_usec < (timeout % 1000U) * 1000UL)) {
+			timeout = (unsigned int) (tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000);
+		}
+	}
+
+	slot->transfer->timeout = timeout;
+	slot->completed = 0;
+	slot->status = 0;
+	if ((rc = libusb_submit_transfer(slot->transfer)) < 0) {
+		return rc;
+	}
+	slot->pending = 1;
+	return 0;
+}
+
+
+
+static int submit_read(struct pk2aux_transfer *slot) {
+	int rc;
+
+	/* IN transfers stay posted for as long as the engine runs, so they get no timeout of
+	 * their own; pk2aux_engine_read() applies the timeout and deadline while waiting. */
+	slot->transfer->timeout = 0;
+	slot->completed = 0;
+	slot->status = 0;
+	if ((rc = libusb_submit_transfer(slot->transfer)) < 0) {
+		return rc;
+	}
+	slot->pending = 1;
+	return 0;
+}
+
+
+
+static void cancel_reads(struct pk2aux_engine *engine) {
+	unsigned int i;
+
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		if (engine->in[i].pending && !engine->in[i].completed) {
+			libusb_cancel_transfer(engine->in[i].transfer);
+		}
+	}
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		if (engine->in[i].pending) {
+			wait_transfer(engine, &engine->in[i]);
+		}
+	}
+	engine->in_head = 0;
+}
+
+
+
+static void restart_reads(struct pk2aux_engine *engine) {
+	unsigned int i;
+
+	/* Once a read has failed, the responses still in flight can no longer be matched up
+	 * with the commands that caused them, so throw them all away and start over. A slot
+	 * that can't be resubmitted now is tried again when it is next read. */
+	cancel_reads(engine);
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		submit_read(&engine->in[i]);
+	}
+}
+
+
+
+static int wait_read(struct pk2aux_engine *engine, struct pk2aux_transfer *slot) {
+	struct timespec now, give_up;
+	struct timeval tv;
+	long long ns;
+	int rc, limited = engine->timeout || engine->has_deadline;
+
+	/* The transfer has no timeout, so the wait gives up by itself at whichever comes
+	 * first of the timeout and the deadline. Giving up leaves the transfer posted. */
+	clock_gettime(CLOCK_MONOTONIC, &give_up);
+	give_up.tv_sec += engine->timeout / 1000U;
+	give_up.tv_nsec += (engine->timeout % 1000U) * 1000000L;
+	if (give_up.tv_nsec >= 1000000000L) {
+		give_up.tv_sec++;
+		give_up.tv_nsec -= 1000000000L;
+	}
+	if (engine->has_deadline && (!engine->timeout || engine->deadline.tv_sec < give_up.tv_sec || (engine->deadline.tv_sec == give_up.tv_sec && engine->deadline.tv_nsec < give_up.tv_nsec))) {
+		give_up = engine->deadline;
+	}
+
+	while (!slot->completed) {
+		if (limited) {
+			clock_gettime(CLOCK_MONOTONIC, &now);
+			ns = (give_up.tv_sec - now.tv_sec) * 1000000000LL + (give_up.tv_nsec - now.tv_nsec);
+			if (ns <= 0) {
+				return LIBUSB_ERROR_TIMEOUT;
+			}
+			tv.tv_sec = ns / 1000000000LL;
+			tv.tv_usec = (ns % 1000000000LL + 999) / 1000;
+			rc = libusb_handle_events_timeout_completed(engine->usb_context, &tv, &slot->completed);
+		} else {
+			rc = libusb_handle_events_completed(engine->usb_context, &slot->completed);
+		}
+		if (rc == LIBUSB_ERROR_INTERRUPTED) {
+			engine->retries++;
+		} else if (rc < 0) {
+			return rc;
+		}
+	}
+
+	return slot->status;
+}
+
+
+
+static int usb_open(struct pk2aux_device_private *device, struct pk2aux_engine *engine) {
+	libusb_device_handle *handle;
+	int *original_config = &engine->original_config;
+	int rc, tmp_config;
+
+	/* Open the PICkit2. */
+	if ((rc = libusb_open(device->usb_device, &handle)) < 0) {
+		return rc;
+	}
+
+	/* Get the configuration index the device was originally in. */
+	if ((rc = libusb_get_configuration(handle, original_config)) < 0) {
+		libusb_close(handle);
+		return rc;
+	}
+	if (!*original_config) {
+		*original_config = -1;
+	}
+
+	/* PICkit2s have 2 configurations; the first is HID and the second is non-HID.
+	 * I suspect using the non-HID configuration may yield better results as it may
+	 * make kernel drivers less likely to grab hold of the PICkit2. */
+	if (*original_config != 2) {
+		if ((rc = libusb_set_configuration(handle, 2)) < 0) {
+			libusb_close(handle);
+			return rc;
+		}
+	}
+
+	/* Claim the interface containing the two endpoints. */
+	if ((rc = libusb_claim_interface(handle, 0)) < 0) {
+		if (*original_config != 2) {
+			libusb_set_configuration(handle, *original_config);
+		}
+		libusb_close(handle);
+		return rc;
+	}
+
+	/* Check that the configuration index hasn't changed since. */
+	if ((rc = libusb_get_configuration(handle, &tmp_config)) < 0 || tmp_config != 2) {
+		libusb_release_interface(handle, 0);
+		if (*original_config != 2) {
+			libusb_set_configuration(handle, *original_config);
+		}
+		libusb_close(handle);
+		return rc < 0 ? rc : LIBUSB_ERROR_BUSY;
+	}
+
+	engine->usb_context = device->usb_context;
+	engine->usb_handle = handle;
+	return 0;
+}
+
+
+
+static void usb_close(struct pk2aux_engine *engine, int reset) {
+	/* A reset device comes back in its power-on configuration anyway. */
+	if (reset) {
+		libusb_reset_device(engine->usb_handle);
+	} else {
+		libusb_release_interface(engine->usb_handle, 0);
+		if (engine->original_config != 2) {
+			libusb_set_configuration(engine->usb_handle, engine->original_config);
+		}
+	}
+	libusb_close(engine->usb_handle);
+}
+
+
+
+static int usb_flush(struct pk2aux_engine *engine) {
+	unsigned int i;
+	int rc, first_error = 0;
+
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		if (engine->out[i].pending) {
+			if ((rc = wait_transfer(engine, &engine->out[i])) < 0 && !first_error) {
+				first_error = rc;
+			}
+		}
+	}
+
+	return first_error;
+}
+
+
+
+static void usb_stop(struct pk2aux_engine *engine) {
+	unsigned int i;
+
+	/* Let outstanding writes finish so commands are not lost, then take back the reads. */
+	usb_flush(engine);
+	cancel_reads(engine);
+
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		if (engine->out[i].transfer) {
+			libusb_free_transfer(engine->out[i].transfer);
+			engine->out[i].transfer = 0;
+		}
+		if (engine->in[i].transfer) {
+			libusb_free_transfer(engine->in[i].transfer);
+			engine->in[i].transfer = 0;
+		}
+	}
+
+#ifdef HAVE_DEV_MEM
+	if (engine->dev_mem) {
+		libusb_dev_mem_free(engine->usb_handle, engine->dev_mem, DEV_MEM_SIZE);
+		engine->dev_mem = 0;
+	}
+#endif
+}
+
+
+
+static int usb_start(struct pk2aux_engine *engine) {
+	libusb_device_handle *handle = engine->usb_handle;
+	unsigned int i;
+	int rc;
+
+	memset(engine->out, 0, sizeof(engine->out));
+	memset(engine->in, 0, sizeof(engine->in));
+	engine->out_next = engine->in_head = 0;
+
+	/* Packets are built and received in place, so they might as well be in device
+	 * memory. Not every platform has any to give out, which is no great loss. */
+	engine->dev_mem = 0;
+#ifdef HAVE_DEV_MEM
+	engine->dev_mem = libusb_dev_mem_alloc(handle, DEV_MEM_SIZE);
+#endif
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		engine->out[i].buffer = engine->dev_mem ? engine->dev_mem + i * 64 : engine->out[i].storage;
+		engine->in[i].buffer = engine->dev_mem ? engine->dev_mem + (PK2AUX_NUM_TRANSFERS + i) * 64 : engine->in[i].storage;
+	}
+
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		engine->out[i].transfer = libusb_alloc_transfer(0);
+		engine->in[i].transfer = libusb_alloc_transfer(0);
+		if (!engine->out[i].transfer || !engine->in[i].transfer) {
+			usb_stop(engine);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		libusb_fill_interrupt_transfer(engine->out[i].transfer, handle, 0x01, engine->out[i].buffer, 64, &transfer_callback, &engine->out[i], PK2AUX_TRANSFER_TIMEOUT);
+		libusb_fill_interrupt_transfer(engine->in[i].transfer, handle, 0x81, engine->in[i].buffer, 64, &transfer_callback, &engine->in[i], 0);
+	}
+
+	/* Keep every IN transfer posted from now on, so that a response is collected in the
+	 * first frame it is ready in rather than waiting for a read to be submitted. */
+	for (i = 0; i < PK2AUX_NUM_TRANSFERS; ++i) {
+		if ((rc = submit_read(&engine->in[i])) < 0) {
+			usb_stop(engine);
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+
+
+static int usb_reserve(struct pk2aux_engine *engine, unsigned char **buffer) {
+	struct pk2aux_transfer *slot = &engine->out[engine->out_next];
+	int rc;
+
+	/* Reuse the oldest OUT slot. If it is still in flight, wait for it; an error
+	 * it hit is reported here, since its own write call has long since returned. */
+	if (slot->pending) {
+		if ((rc = wait_transfer(engine, slot)) < 0) {
+			return rc;
+		}
+	}
+
+	*buffer = slot->buffer;
+	return 0;
+}
+
+
+
+static int usb_submit(struct pk2aux_engine *engine, size_t length) {
+	struct pk2aux_transfer *slot = &engine->out[engine->out_next];
+	int rc;
+
+	memset(slot->buffer + length, END_OF_BUFFER, 64 - length);
+	if ((rc = submit_transfer(engine, slot)) < 0) {
+		return rc;
+	}
+
+	engine->out_next = (engine->out_next + 1) % PK2AUX_NUM_TRANSFERS;
+	return 0;
+}
+
+
+
+static int usb_read(struct pk2aux_engine *engine, void *data) {
+	struct pk2aux_transfer *slot = &engine->in[engine->in_head];
+	int rc;
+
+	/* A response implies the command was delivered, but collect write errors first
+	 * so that a failed command is reported as such rather than as a read timeout. */
+	if ((rc = usb_flush(engine)) < 0) {
+		restart_reads(engine);
+		return rc;
+	}
+
+	if (!slot->pending && (rc = submit_read(slot)) < 0) {
+		return rc;
+	}
+	if ((rc = wait_read(engine, slot)) < 0) {
+		restart_reads(engine);
+		return rc;
+	}
+
+	/* Hand the slot straight back to the device for a later response. */
+	memcpy(data, slot->buffer, 64);
+	slot->pending = 0;
+	engine->in_head = (engine->in_head + 1) % PK2AUX_NUM_TRANSFERS;
+	submit_read(slot);
+	return 0;
+}
+
+
+
+static int usb_ready(struct pk2aux_engine *engine) {
+	/* Completions are only noticed while libusb events are being handled. */
+	return engine->in[engine->in_head].completed;
+}
+
+
+
+const struct pk2aux_transport pk2aux_usb_transport = {
+	&usb_open,
+	&usb_close,
+	&usb_start,
+	&usb_stop,
+	&usb_reserve,
+	&usb_submit,
+	&usb_read,
+	&usb_flush,
+	&usb_ready
+};
@@ -25,9 +25,19 @@
 
 static const struct option LONG_OPTIONS[] = {
 	{"help", no_argument, 0, 'h'},
+	{"watch", no_argument, 0, 'w'},
 	{0, 0, 0, 0}
 };
-static const char SHORT_OPTIONS[] = "h";
+static const char SHORT_OPTIONS[] = "hw";
+
+
+
+static void hotplug(const pk2aux_device *device, enum PK2AUX_HOTPLUG_EVENT event, void *user_data) {
+	(void) user_data;
+
+	printf("%c%d:%d\t%s\n", event == PK2AUX_HOTPLUG_ARRIVED ? '+' : '-', device->bus_number, device->device_address, device->unit_id);
+	fflush(stdout);
+}
 
 
 
@@ -36,6 +46,8 @@ static void usage(const char *appname) {
 			"Usage: %s [options]\n"
 			"Options:\n"
 			" -h, --help    display this usage message\n"
+			" -w, --watch   after listing, keep running and report devices as they are\n"
+			"               plugged in (prefixed by +) and unplugged (prefixed by -)\n"
 			"\n"
 			"Displays a list of all PICkit2 devices attached to the system, along with the\n"
 			"bus number and device address of each.\n",
@@ -48,6 +60,7 @@ int main(int argc, char **argv) {
 	pk2aux_device_list dlist;
 	unsigned int i;
 	int rc;
+	int watch = 0;
 
 	/* Parse arguments. */
 	while ((rc = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, 0)) != -1) {
@@ -55,6 +68,10 @@ int main(int argc, char **argv) {
 			case 'h':
 				usage(argv[0]);
 				return EXIT_SUCCESS;
+
+			case 'w':
+				watch = 1;
+				break;
 				
 			default:
 				return EXIT_FAILURE;
@@ -74,7 +91,22 @@ int main(int argc, char **argv) {
 	/* Display a list of devices. */
 	dlist = pk2aux_get_devices();
 	for (i = 0; i < dlist.num_devices; i++) {
-		printf("%d:%d\t%s\n", dlist.devices[i].bus_number, dlist.devices[i].device_address, dlist.devices[i].unit_id);
+		printf("%d:%d\t%s\n", dlist.devices[i]->bus_number, dlist.devices[i]->device_address, dlist.devices[i]->unit_id);
+	}
+	pk2aux_free_device_list(dlist);
+
+	/* Report changes until killed. */
+	if (watch) {
+		fflush(stdout);
+		if ((rc = pk2aux_hotplug_start(&hotplug, 0)) < 0) {
+			fprintf(stderr, "%s: %s\n", argv[0], pk2aux_error_string(rc));
+			pk2aux_exit();
+			return 1;
+		}
+		while ((rc = pk2aux_hotplug_poll(1000)) == 0);
+		fprintf(stderr, "%s: %s\n", argv[0], pk2aux_error_string(rc));
+		pk2aux_exit();
+		return 1;
 	}
 
 	/* Deinitialize the library. */
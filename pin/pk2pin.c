@@ -40,9 +40,10 @@ static const struct option LONG_OPTIONS[] = {
 	{"aux", required_argument, 0, AUX_OPT},
 	{"query", no_argument, 0, 'q'},
 	{"help", no_argument, 0, 'h'},
+	{"stats", no_argument, 0, 's'},
 	{0, 0, 0, 0}
 };
-static const char SHORT_OPTIONS[] = "hq";
+static const char SHORT_OPTIONS[] = "hqs";
 
 
 
@@ -79,33 +80,17 @@ static int parse_level(const char *level_string, double *level, double min_level
 
 static int do_query(pk2aux_handle handle) {
 	int rc;
-	double voltage;
-	unsigned int level;
+	pk2aux_snapshot snapshot;
 
-	if ((rc = pk2aux_get_vdd_level(handle, &voltage)) < 0) {
+	if ((rc = pk2aux_get_snapshot(handle, &snapshot)) < 0) {
 		return rc;
 	}
-	printf("VDD: %.2f\n", voltage);
 
-	if ((rc = pk2aux_get_vpp_level(handle, &voltage)) < 0) {
-		return rc;
-	}
-	printf("VPP: %.2f\n", voltage);
-
-	if ((rc = pk2aux_get_pgc(handle, &level)) < 0) {
-		return rc;
-	}
-	printf("PGC: %d\n", level);
-
-	if ((rc = pk2aux_get_pgd(handle, &level)) < 0) {
-		return rc;
-	}
-	printf("PGD: %d\n", level);
-
-	if ((rc = pk2aux_get_aux(handle, &level)) < 0) {
-		return rc;
-	}
-	printf("AUX: %d\n", level);
+	printf("VDD: %.2f\n", snapshot.vdd_level);
+	printf("VPP: %.2f\n", snapshot.vpp_level);
+	printf("PGC: %d\n", snapshot.pgc_level);
+	printf("PGD: %d\n", snapshot.pgd_level);
+	printf("AUX: %d\n", snapshot.aux_level);
 
 	return 0;
 }
@@ -127,6 +112,7 @@ static void usage(const char *appname) {
 			" --pgd mode               where mode is one of `grounded', `floating', `high'\n"
 			" --aux mode               where mode is one of `grounded', `floating', `high'\n"
 			" --query                  show the levels of VDD/VPP, states of PGC/PGD/AUX\n"
+			" -s, --stats              print traffic statistics to stderr on exit\n"
 			"\n"
 			"Reads or sets the values of the I/O pins on the PICkit2's ICSP interface.\n"
 			"\n"
@@ -172,6 +158,7 @@ int main(int argc, char **argv) {
 	enum PIN_MODE aux_mode = PIN_MODE_GROUNDED;
 	double vdd_level = -1.0, vpp_level = -1.0;
 	unsigned int query = 0;
+	int dump_stats = 0;
 	pk2aux_device *device = 0;
 	pk2aux_handle handle = 0;
 
@@ -234,6 +221,10 @@ int main(int argc, char **argv) {
 				usage(argv[0]);
 				return EXIT_SUCCESS;
 
+			case 's':
+				dump_stats = 1;
+				break;
+
 			case 'q':
 				query = 1;
 				break;
@@ -257,7 +248,7 @@ int main(int argc, char **argv) {
 	}
 
 	/* Initialize the library. */
-	if ((rc = pk2aux_init()) < 0) {
+	if ((rc = pk2aux_init_ex(PK2AUX_INIT_LAZY)) < 0) {
 		goto errout;
 	}
 
@@ -273,6 +264,9 @@ int main(int argc, char **argv) {
 		goto errout;
 	}
 
+	/* Send the settings in as few USB transactions as possible. */
+	pk2aux_batch_begin(handle);
+
 	/* If VDD/VPP are having both levels and modes set, it the order in which we do these
 	 * depends on the mode being set. If the mode is being set to HIGH, we want to set
 	 * the level first so that the target circuit doesn't see the old level for a moment.
@@ -306,10 +300,17 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	/* The levels have to actually reach the device before we start waiting. */
+	if ((rc = pk2aux_batch_commit(handle)) < 0) {
+		goto errout;
+	}
+
 	/* If we're setting the VPP mode to high and we also changed its voltage, sleep for
 	 * 100ms here to allow the charge pump to stabilize. */
 	usleep(100000);
 
+	pk2aux_batch_begin(handle);
+
 	/* Set the modes of all the pins whose modes were requested to be changed. */
 	if (vdd_set_mode) {
 		if ((rc = pk2aux_set_vdd_mode(handle, vdd_mode)) < 0) {
@@ -336,6 +337,9 @@ int main(int argc, char **argv) {
 			goto errout;
 		}
 	}
+	if ((rc = pk2aux_batch_commit(handle)) < 0) {
+		goto errout;
+	}
 
 	/* If we were given the query option, do the query and display the results. */
 	if (query) {
@@ -348,6 +352,9 @@ int main(int argc, char **argv) {
 
 out:
 	if (handle) {
+		if (dump_stats) {
+			pk2aux_dump_stats(handle, stderr);
+		}
 		pk2aux_close(handle);
 	}
 	pk2aux_exit();
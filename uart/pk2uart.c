@@ -16,17 +16,23 @@
  * You should have received a copy of the GNU General Public License
  * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
  */
+#define _GNU_SOURCE
 #include "pk2aux.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <libusb.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <termios.h>
+#include <time.h>
 #include <unistd.h>
-#include <sys/select.h>
+#include <sys/epoll.h>
 
 
 
@@ -34,96 +40,424 @@ static const struct option LONG_OPTIONS[] = {
 	{"device", required_argument, 0, 'd'},
 	{"baud", required_argument, 0, 'b'},
 	{"help", no_argument, 0, 'h'},
+	{"stats", no_argument, 0, 's'},
+	{"pty", no_argument, 0, 'p'},
 	{0, 0, 0, 0}
 };
-static const char SHORT_OPTIONS[] = "d:b:h";
+static const char SHORT_OPTIONS[] = "d:b:hsp";
+
+/* The terminal speeds the UART can run at. */
+static const struct {
+	speed_t speed;
+	unsigned int baud;
+} SPEEDS[] = {
+	{B110, 110},
+	{B134, 134},
+	{B150, 150},
+	{B200, 200},
+	{B300, 300},
+	{B600, 600},
+	{B1200, 1200},
+	{B1800, 1800},
+	{B2400, 2400},
+	{B4800, 4800},
+	{B9600, 9600},
+	{B19200, 19200},
+	{B38400, 38400},
+	{B57600, 57600}
+};
+
+/* Set by a signal asking us to stop. */
+static volatile sig_atomic_t stopping;
+
+
+
+/* The fastest the device is polled while data is arriving, in microseconds: once a frame. */
+#define MIN_POLL 1000
+
+/* How long polling stays fast after the line was last busy, in character times. */
+#define LINGER 16
+
+/* How much is read from the input at a time. */
+#define IN_SIZE 4096
+
+/* How much received data is held while the output can't keep up. */
+#define OUT_SIZE 65536
+
+
+
+static long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+
+static int watch(int epfd, int fd, uint32_t events, int *watched) {
+	struct epoll_event event;
+	int op;
+
+	/* Add, change or remove a descriptor's entry in the set, as needed. */
+	if (events == (uint32_t) *watched) {
+		return 0;
+	}
+	op = !events ? EPOLL_CTL_DEL : *watched ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.fd = fd;
+	if (epoll_ctl(epfd, op, fd, &event) < 0) {
+		return -1;
+	}
+	*watched = (int) events;
+	return 0;
+}
 
 
 
-static int do_uart(const char *appname, pk2aux_handle handle, unsigned int poll_interval) {
+static int watch_device(int epfd) {
+	pk2aux_pollfd fds[16];
+	struct epoll_event event;
+	int count, i;
+
+	/* The library's descriptors wake the loop when an answer arrives. Without any (a simulated
+	 * device, or a platform that has none) the loop falls back on pk2aux_get_timeout(). */
+	count = pk2aux_get_pollfds(fds, sizeof(fds) / sizeof(*fds));
+	if (count == LIBUSB_ERROR_NOT_SUPPORTED) {
+		return 0;
+	}
+	if (count < 0) {
+		return count;
+	}
+	if (count > (int) (sizeof(fds) / sizeof(*fds))) {
+		count = (int) (sizeof(fds) / sizeof(*fds));
+	}
+	for (i = 0; i < count; ++i) {
+		memset(&event, 0, sizeof(event));
+		event.events = ((fds[i].events & POLLIN) ? EPOLLIN : 0) | ((fds[i].events & POLLOUT) ? EPOLLOUT : 0);
+		event.data.fd = fds[i].fd;
+		if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i].fd, &event) < 0) {
+			return LIBUSB_ERROR_IO;
+		}
+	}
+	return count;
+}
+
+
+
+static int follow_baud(const char *appname, pk2aux_handle handle, int fd, speed_t *speed, unsigned int *baud) {
+	struct termios tio;
+	unsigned int i;
 	int rc;
+
+	/* A client changes the baud rate on its side of the pseudo-terminal, which the master
+	 * sees in the shared settings. Act only when they change. */
+	if (tcgetattr(fd, &tio) < 0 || cfgetospeed(&tio) == *speed) {
+		return 0;
+	}
+	*speed = cfgetospeed(&tio);
+
+	for (i = 0; i < sizeof(SPEEDS) / sizeof(*SPEEDS) && SPEEDS[i].speed != *speed; ++i);
+	if (i == sizeof(SPEEDS) / sizeof(*SPEEDS)) {
+		fprintf(stderr, "%s: baud rate change not supported, staying at %u\n", appname, *baud);
+		return 0;
+	}
+	if (SPEEDS[i].baud == *baud) {
+		return 0;
+	}
+
+	/* Whatever is queued goes out at the old rate first. An answer still on its way was
+	 * received at the old rate and is dropped. */
+	if ((rc = pk2aux_stop_uart(handle)) < 0 || (rc = pk2aux_start_uart(handle, SPEEDS[i].baud)) < 0) {
+		return rc;
+	}
+	*baud = SPEEDS[i].baud;
+	return 1;
+}
+
+
+
+static int do_uart(const char *appname, pk2aux_handle handle, unsigned int baud, int in_fd, int out_fd, int pty) {
+	static unsigned char in[IN_SIZE], out[OUT_SIZE];
+	struct epoll_event events[18];
 	struct timeval tv;
-	fd_set rfds, wfds, efds;
-	unsigned char buffer[64];
-	size_t length, sent;
+	struct termios tio;
+	speed_t speed = 0;
+	size_t in_head = 0, in_used = 0, out_head = 0, out_used = 0, length;
+	long long now, interval = MIN_POLL, max_interval, next_poll, busy_until, char_us, wait;
+	int epfd, device_fds, in_watched = 0, out_watched = 0, in_always = 0, in_eof = 0, asked = 0;
+	uint32_t in_events, out_events;
+	int count, i, rc;
 	ssize_t rwrc;
-	int selectrc;
+
+	/* Idle, the device is polled less and less often, but often enough to collect what it has
+	 * received before half its 128-byte buffer fills and data starts to be lost. */
+	char_us = 10 * 1000000LL / baud;
+	max_interval = 64 * char_us;
+	next_poll = busy_until = now_us();
+	if (pty && tcgetattr(in_fd, &tio) == 0) {
+		speed = cfgetospeed(&tio);
+	}
+
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+		perror(appname);
+		return LIBUSB_ERROR_IO;
+	}
+	if ((device_fds = watch_device(epfd)) < 0) {
+		fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(device_fds));
+		close(epfd);
+		return device_fds;
+	}
 
 	for (;;) {
-		/* Try reading from the PICkit2's UART. */
-		length = sizeof(buffer);
-		if ((rc = pk2aux_receive_uart(handle, buffer, &length)) < 0) {
-			fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
-			return rc;
+		/* A signal asks us to stop, once queued data is out (which stopping the UART does). */
+		if (stopping) {
+			rc = LIBUSB_SUCCESS;
+			break;
 		}
 
-		/* If we read some data, dump it to stdout. */
-		sent = 0;
-		while (sent < length) {
-			/* Try to write the data. */
-			do {
-				rwrc = write(1, buffer + sent, length - sent);
-			} while (rwrc < 0 && errno == EINTR);
-			if (rwrc == 0 || (rwrc < 0 && errno == EAGAIN)) {
-				/* The write would have blocked (although we set only stdin to nonblocking,
-				 * if they are both the TTY, this will also set stdout to nonblocking).
-				 * Use select with no timeout to wait until the write is possible. */
-				FD_ZERO(&wfds);
-				FD_SET(1, &wfds);
-				selectrc = select(2, 0, &wfds, 0, 0);
-				if (selectrc < 0 && errno != EINTR) {
+		/* Once the input has ended and everything has been handed over, we're done. */
+		if (in_eof && !in_used) {
+			rc = LIBUSB_SUCCESS;
+			break;
+		}
+
+		/* Follow the baud rate a pseudo-terminal's client asks for. */
+		if (pty && (rc = follow_baud(appname, handle, in_fd, &speed, &baud)) != 0) {
+			if (rc < 0) {
+				fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
+				break;
+			}
+			asked = 0;
+			char_us = 10 * 1000000LL / baud;
+			max_interval = 64 * char_us;
+			interval = MIN_POLL;
+			next_poll = busy_until = now_us();
+		}
+
+		/* Watch the input while there's room to read into, and the output while it's full.
+		 * A pseudo-terminal's master is both, so it has a single entry. Regular files can't
+		 * be watched, but never make a reader wait either. */
+		in_events = !in_always && !in_eof && !in_used ? EPOLLIN : 0;
+		out_events = out_used ? EPOLLOUT : 0;
+		if (in_fd == out_fd) {
+			rc = watch(epfd, in_fd, in_events | out_events, &in_watched);
+		} else if ((rc = watch(epfd, in_fd, in_events, &in_watched)) < 0 && errno == EPERM) {
+			in_always = 1;
+			rc = 0;
+		}
+		if (rc < 0 || (in_fd != out_fd && watch(epfd, out_fd, out_events, &out_watched) < 0)) {
+			perror(appname);
+			rc = LIBUSB_ERROR_IO;
+			break;
+		}
+
+		/* Ask the device for what it has received when the next poll is due, as long as there
+		 * is room to hold the answer until the output can take it. */
+		now = now_us();
+		if (!asked && sizeof(out) - out_used >= IN_SIZE && now >= next_poll) {
+			if ((rc = pk2aux_request_uart(handle)) < 0) {
+				fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
+				break;
+			}
+			asked = 1;
+		}
+
+		/* Sleep until something happens or there's something to do: the next poll, the answer
+		 * if nothing will wake us for it, or room for queued data in the device's buffer. */
+		wait = -1;
+		if (in_always && !in_eof && !in_used) {
+			wait = 0;
+		} else if (asked) {
+			if (!device_fds || pk2aux_get_timeout(&tv) > 0) {
+				wait = device_fds ? tv.tv_sec * 1000000LL + tv.tv_usec : MIN_POLL;
+			}
+		} else if (sizeof(out) - out_used >= IN_SIZE) {
+			wait = next_poll > now ? next_poll - now : 0;
+		}
+		if (pk2aux_uart_queued(handle, &tv)) {
+			if (wait < 0 || tv.tv_sec * 1000000LL + tv.tv_usec < wait) {
+				wait = tv.tv_sec * 1000000LL + tv.tv_usec;
+			}
+		}
+		count = epoll_wait(epfd, events, sizeof(events) / sizeof(*events), wait < 0 ? -1 : (int) ((wait + 999) / 1000));
+		if (count < 0 && errno != EINTR) {
+			perror(appname);
+			rc = LIBUSB_ERROR_IO;
+			break;
+		}
+
+		for (i = 0; i < count; ++i) {
+			if (events[i].data.fd == in_fd && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !in_used) {
+				/* Read as much as there is, up to a whole buffer. */
+				do {
+					rwrc = read(in_fd, in, sizeof(in));
+				} while (rwrc < 0 && errno == EINTR);
+				if (rwrc < 0 && errno != EAGAIN) {
 					perror(appname);
-					return LIBUSB_ERROR_IO;
+					rc = LIBUSB_ERROR_IO;
+					goto out;
+				}
+				if (rwrc == 0) {
+					in_eof = 1;
+				} else if (rwrc > 0) {
+					in_head = 0;
+					in_used = (size_t) rwrc;
 				}
-			} else if (rwrc < 0) {
-				/* The write encountered an error. */
+			}
+		}
+		if (in_always && !in_eof && !in_used) {
+			do {
+				rwrc = read(in_fd, in, sizeof(in));
+			} while (rwrc < 0 && errno == EINTR);
+			if (rwrc < 0) {
 				perror(appname);
-				return LIBUSB_ERROR_IO;
-			} else {
-				/* The write wrote rwrc bytes worth of data. */
-				sent += rwrc;
+				rc = LIBUSB_ERROR_IO;
+				break;
+			}
+			in_eof = !rwrc;
+			in_head = 0;
+			in_used = (size_t) rwrc;
+		}
+
+		/* Queue what was read for the device, which takes it as fast as the line allows. A
+		 * response is likely to follow, so poll quickly until a while after it has gone out. */
+		if (in_used) {
+			length = in_used;
+			if ((rc = pk2aux_queue_uart(handle, in + in_head, &length)) < 0) {
+				fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
+				break;
+			}
+			in_head += length;
+			in_used -= length;
+			if (length) {
+				busy_until = (busy_until > now ? busy_until : now) + (long long) length * char_us;
+				interval = MIN_POLL;
+				if (next_poll > now + interval) {
+					next_poll = now + interval;
+				}
+			}
+		} else if ((rc = pk2aux_pump_uart(handle)) < 0) {
+			fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
+			break;
+		}
+
+		/* Collect the answer once it's here, after whatever the output hasn't taken yet. Poll
+		 * quickly while the line is busy either way, and back off exponentially once it has
+		 * been quiet for a while. */
+		if (device_fds && (rc = pk2aux_handle_events()) < 0) {
+			fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
+			break;
+		}
+		if (asked && pk2aux_uart_ready(handle)) {
+			if (out_head) {
+				memmove(out, out + out_head, out_used);
+				out_head = 0;
+			}
+			length = sizeof(out) - out_used;
+			if ((rc = pk2aux_receive_uart(handle, out + out_used, &length)) < 0) {
+				fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
+				break;
 			}
+			asked = 0;
+			out_used += length;
+			now = now_us();
+			if (length && busy_until < now) {
+				busy_until = now;
+			}
+			if (now < busy_until + LINGER * char_us) {
+				interval = MIN_POLL;
+			} else if ((interval *= 2) > max_interval) {
+				interval = max_interval;
+			}
+			next_poll = now + interval;
 		}
 
-		/* Wait up to the polling interval to see some data from stdin - after
-		 * that, go back and poll the PICkit2 again. */
-		do {
-			FD_ZERO(&rfds);
-			FD_SET(0, &rfds);
-			FD_ZERO(&efds);
-			FD_SET(0, &efds);
-			tv.tv_sec = poll_interval / 1000U;
-			tv.tv_usec = (poll_interval % 1000U) * 1000U;
-			selectrc = select(1, &rfds, 0, &efds, &tv);
-		} while (selectrc < 0 && errno == EINTR);
-
-		/* Check if there's data available for reading from stdin. */
-		if (FD_ISSET(0, &rfds) || FD_ISSET(0, &efds)) {
-			/* Read some data. */
+		/* Pass received data on, waiting for the output to be writable if it's full (stdout
+		 * is nonblocking too if it shares the terminal with stdin). */
+		while (out_used) {
 			do {
-				rwrc = read(0, buffer, sizeof(buffer));
+				rwrc = write(out_fd, out + out_head, out_used);
 			} while (rwrc < 0 && errno == EINTR);
 			if (rwrc < 0 && errno != EAGAIN) {
 				perror(appname);
-				return LIBUSB_ERROR_IO;
+				rc = LIBUSB_ERROR_IO;
+				goto out;
 			}
-			if (rwrc == 0) {
-				return LIBUSB_SUCCESS;
-			}
-			if (rwrc > 0) {
-				/* Send the bytes to the PICkit2. */
-				if ((rc = pk2aux_send_uart(handle, buffer, rwrc)) < 0) {
-					fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
-					return rc;
-				}
+			if (rwrc <= 0) {
+				break;
 			}
+			out_head += (size_t) rwrc;
+			out_used -= (size_t) rwrc;
+		}
+		if (!out_used) {
+			out_head = 0;
 		}
 	}
+
+out:
+	close(epfd);
+	return rc;
 }
 
 
 
-static int parse_baud(const char *baud_string, unsigned int *baud, unsigned int *poll_interval) {
+static int open_pty(const char *appname, unsigned int baud, int *master, int *slave) {
+	struct termios tio;
+	const char *name;
+	unsigned int i;
+
+	*master = *slave = -1;
+	if ((*master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC)) < 0 || grantpt(*master) < 0 || unlockpt(*master) < 0 || !(name = ptsname(*master))) {
+		goto err;
+	}
+
+	/* Holding the slave open keeps the master usable while no client has it open, so clients
+	 * can come and go. */
+	if ((*slave = open(name, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0 || tcgetattr(*slave, &tio) < 0) {
+		goto err;
+	}
+
+	/* Start out raw, at the baud rate we were given if the terminal has a name for it. */
+	cfmakeraw(&tio);
+	for (i = 0; i < sizeof(SPEEDS) / sizeof(*SPEEDS); ++i) {
+		if (SPEEDS[i].baud == baud) {
+			cfsetispeed(&tio, SPEEDS[i].speed);
+			cfsetospeed(&tio, SPEEDS[i].speed);
+		}
+	}
+	if (tcsetattr(*slave, TCSANOW, &tio) < 0) {
+		goto err;
+	}
+
+	/* Say where to find it. */
+	printf("%s\n", name);
+	fflush(stdout);
+	return 0;
+
+err:
+	perror(appname);
+	if (*slave >= 0) {
+		close(*slave);
+	}
+	if (*master >= 0) {
+		close(*master);
+	}
+	*master = *slave = -1;
+	return LIBUSB_ERROR_IO;
+}
+
+
+
+static void stop(int signum) {
+	(void) signum;
+	stopping = 1;
+}
+
+
+
+static int parse_baud(const char *baud_string, unsigned int *baud) {
 	char *ptr;
 	unsigned long rc;
 
@@ -138,10 +472,6 @@ static int parse_baud(const char *baud_string, unsigned int *baud, unsigned int
 		return -1;
 
 	*baud = (unsigned int) rc;
-	*poll_interval = (unsigned int) (1000.0 / (*baud / 10.0 / 128.0) * 1.0 / 10.0);
-	if (!*poll_interval) {
-		*poll_interval = 1;
-	}
 	return 0;
 }
 
@@ -152,7 +482,9 @@ static void usage(const char *appname) {
 			"Options:\n"
 			" -d path, --device path      the path to the PICkit2, as printed by pk2ls\n"
 			" -b speed, --baud speed      sets the baud rate of the serial port (REQUIRED, must be between 92 and 57600)\n"
-			" -h, --help                  display this usage message\n",
+			" -h, --help                  display this usage message\n"
+			" -s, --stats                 print traffic statistics to stderr on exit\n"
+			" -p, --pty                   bridge a pseudo-terminal, whose path is printed, instead of stdin and stdout\n",
 			appname);
 }
 
@@ -161,11 +493,14 @@ static void usage(const char *appname) {
 int main(int argc, char **argv) {
 	int rc;
 	const char *path = 0;
-	unsigned int baud = 0, poll_interval = 0;
-	int old_flags;
+	unsigned int baud = 0;
+	int old_flags = -1;
 	pk2aux_device *device = 0;
 	pk2aux_handle handle = 0;
 	int in_uart_mode = 0;
+	int dump_stats = 0;
+	int pty = 0, master = -1, slave = -1;
+	struct sigaction action;
 
 	while ((rc = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, 0)) != -1) {
 		switch (rc) {
@@ -174,7 +509,7 @@ int main(int argc, char **argv) {
 				break;
 
 			case 'b':
-				if (parse_baud(optarg, &baud, &poll_interval) < 0 || baud < 92 || baud > 57600) {
+				if (parse_baud(optarg, &baud) < 0 || baud < 92 || baud > 57600) {
 					fprintf(stderr, "%s: baud rate '%s' is illegal\n", argv[0], optarg);
 					return EXIT_FAILURE;
 				}
@@ -184,6 +519,14 @@ int main(int argc, char **argv) {
 				usage(argv[0]);
 				return EXIT_SUCCESS;
 
+			case 's':
+				dump_stats = 1;
+				break;
+
+			case 'p':
+				pty = 1;
+				break;
+
 			default:
 				return EXIT_FAILURE;
 		}
@@ -194,19 +537,30 @@ int main(int argc, char **argv) {
 		return EXIT_FAILURE;
 	}
 
-	/* Make standard input nonblocking so we can poll the PICkit2 regularly. */
-	old_flags = fcntl(0, F_GETFL);
-	if (old_flags < 0) {
-		perror(argv[0]);
-		return EXIT_FAILURE;
-	}
-	if (fcntl(0, F_SETFL, old_flags | O_NONBLOCK) < 0) {
-		perror(argv[0]);
-		return EXIT_FAILURE;
+	/* Make standard input nonblocking so reading it never holds up the PICkit2. */
+	if (!pty) {
+		old_flags = fcntl(0, F_GETFL);
+		if (old_flags < 0) {
+			perror(argv[0]);
+			return EXIT_FAILURE;
+		}
+		if (fcntl(0, F_SETFL, old_flags | O_NONBLOCK) < 0) {
+			perror(argv[0]);
+			return EXIT_FAILURE;
+		}
 	}
 
+	/* Stop cleanly when asked to, leaving a second request to stop at once. */
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = &stop;
+	action.sa_flags = SA_RESETHAND;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGINT, &action, 0);
+	sigaction(SIGTERM, &action, 0);
+	sigaction(SIGHUP, &action, 0);
+
 	/* Initialize the library. */
-	if ((rc = pk2aux_init()) < 0) {
+	if ((rc = pk2aux_init_ex(PK2AUX_INIT_LAZY)) < 0) {
 		goto errout;
 	}
 
@@ -228,19 +582,33 @@ int main(int argc, char **argv) {
 	}
 	in_uart_mode = 1;
 
+	/* Open the pseudo-terminal, if we're bridging one. */
+	if (pty && (rc = open_pty(argv[0], baud, &master, &slave)) < 0) {
+		goto out;
+	}
+
 	/* Do UART stuff! */
-	rc = do_uart(argv[0], handle, poll_interval);
+	rc = do_uart(argv[0], handle, baud, pty ? master : 0, pty ? master : 1, pty);
 
 out:
 	if (in_uart_mode) {
 		pk2aux_stop_uart(handle);
 	}
 	if (handle) {
+		if (dump_stats) {
+			pk2aux_dump_stats(handle, stderr);
+		}
 		pk2aux_close(handle);
 		handle = 0;
 	}
 	pk2aux_exit();
-	fcntl(0, F_SETFL, old_flags);
+	if (master >= 0) {
+		close(slave);
+		close(master);
+	}
+	if (old_flags >= 0) {
+		fcntl(0, F_SETFL, old_flags);
+	}
 	return rc == LIBUSB_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
 
 errout:
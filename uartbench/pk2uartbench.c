@@ -0,0 +1,400 @@
+/*
+ * Copyright 2008 Christopher Head
+ *
+ * This file is part of PK2Aux.
+ *
+ * PK2Aux is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * PK2Aux is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with PK2Aux.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pk2aux.h"
+#include <getopt.h>
+#include <libusb.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+
+
+static const struct option LONG_OPTIONS[] = {
+	{"device", required_argument, 0, 'd'},
+	{"baud", required_argument, 0, 'b'},
+	{"bytes", required_argument, 0, 'n'},
+	{"rounds", required_argument, 0, 'r'},
+	{"help", no_argument, 0, 'h'},
+	{"stats", no_argument, 0, 's'},
+	{0, 0, 0, 0}
+};
+static const char SHORT_OPTIONS[] = "d:b:n:r:hs";
+static int dump_stats = 0;
+
+/* The baud rates measured unless others are asked for. */
+static const unsigned int DEFAULT_BAUDS[] = { 9600, 19200, 38400, 57600 };
+
+/* How much is handed to pk2aux_send_uart() at a time: what fits in one packet. */
+#define CHUNK 62
+
+/* How long to wait for data still on its way, in microseconds, once enough time has passed for
+ * the device's 256-byte transmit and 128-byte receive buffers to empty. */
+#define SETTLE 50000
+
+/* How long a single round trip may take before its byte is counted as lost, in microseconds. */
+#define ROUND_TIMEOUT 1000000
+
+/* The results for one baud rate. Missing counts the streamed bytes that never came back, and
+ * mismatch is the offset of the first one that came back different, or -1 if none did. */
+struct result {
+	unsigned int baud;
+	double bytes_per_second;
+	double rtt[4];
+	double transactions_per_byte;
+	unsigned long long missing;
+	long long mismatch;
+	unsigned int rounds_lost;
+};
+
+
+
+static long long now_us(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+
+
+static unsigned char pattern(size_t i) {
+	/* Not a multiple of 256 long, so dropped bytes don't line up with the data after them. */
+	return (unsigned char) (i * 7 + i / 251);
+}
+
+
+
+static int compare_rtt(const void *x, const void *y) {
+	long long a = *(const long long *) x, b = *(const long long *) y;
+
+	return a < b ? -1 : a > b;
+}
+
+
+
+static int measure_throughput(pk2aux_handle handle, unsigned int baud, size_t bytes, struct result *result) {
+	unsigned char chunk[CHUNK], *received;
+	size_t sent = 0, got = 0, length, i;
+	long long start, last, drain;
+	pk2aux_stats *stats;
+	int rc;
+
+	received = malloc(bytes);
+	stats = malloc(sizeof(*stats));
+	if (!received || !stats) {
+		free(received);
+		free(stats);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	pk2aux_reset_stats(handle);
+	start = last = now_us();
+
+	/* Send a packet's worth at a time, which waits for room in the device, and collect what
+	 * has come back in between so the device's receive buffer never overflows. */
+	while (sent < bytes) {
+		length = bytes - sent < CHUNK ? bytes - sent : CHUNK;
+		for (i = 0; i < length; ++i) {
+			chunk[i] = pattern(sent + i);
+		}
+		if ((rc = pk2aux_send_uart(handle, chunk, length)) < 0) {
+			goto out;
+		}
+		sent += length;
+
+		length = bytes - got;
+		if ((rc = pk2aux_receive_uart(handle, received + got, &length)) < 0) {
+			goto out;
+		}
+		if (length) {
+			got += length;
+			last = now_us();
+		}
+	}
+
+	/* Collect the rest, giving up once it has had time to arrive. */
+	drain = now_us() + (256LL + 128LL) * 10 * 1000000LL / baud + SETTLE;
+	while (got < bytes && now_us() < drain) {
+		length = bytes - got;
+		if ((rc = pk2aux_receive_uart(handle, received + got, &length)) < 0) {
+			goto out;
+		}
+		if (length) {
+			got += length;
+			last = now_us();
+		}
+	}
+
+	/* Past the first difference, the rest can't be told apart from data that moved up to fill
+	 * a gap, so only where that happened is reported, apart from how much never arrived. */
+	for (i = 0; i < got && received[i] == pattern(i); ++i);
+	result->missing = bytes - got;
+	result->mismatch = i < got ? (long long) i : -1;
+	result->bytes_per_second = last > start ? got * 1.0e6 / (last - start) : 0.0;
+
+	pk2aux_get_stats(handle, stats);
+	result->transactions_per_byte = (double) (stats->total.writes + stats->total.reads) / bytes;
+	rc = 0;
+
+out:
+	free(received);
+	free(stats);
+	return rc;
+}
+
+
+
+static int measure_latency(pk2aux_handle handle, unsigned int rounds, struct result *result) {
+	static const double PERCENTILES[] = { 0.50, 0.90, 0.99, 1.00 };
+	unsigned char byte, echo, stale[64];
+	size_t length;
+	long long *rtt, start;
+	unsigned int round, done = 0, i;
+	int rc = 0;
+
+	if (!rounds) {
+		return 0;
+	}
+	if (!(rtt = malloc(rounds * sizeof(*rtt)))) {
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	/* Send one byte at a time, and wait for it to come back before sending the next. */
+	for (round = 0; round < rounds; ++round) {
+		byte = pattern(round);
+
+		/* Throw away whatever has turned up since the last round, so that the late echo of a
+		 * round that timed out is not taken for this one's. */
+		do {
+			length = sizeof(stale);
+			if ((rc = pk2aux_receive_uart(handle, stale, &length)) < 0) {
+				goto out;
+			}
+		} while (length);
+
+		start = now_us();
+		if ((rc = pk2aux_send_uart(handle, &byte, 1)) < 0) {
+			goto out;
+		}
+
+		/* Any other byte is from an earlier round, still arriving; consecutive rounds send
+		 * different bytes. */
+		do {
+			length = 1;
+			if ((rc = pk2aux_receive_uart(handle, &echo, &length)) < 0) {
+				goto out;
+			}
+		} while ((!length || echo != byte) && now_us() - start < ROUND_TIMEOUT);
+
+		if (length && echo == byte) {
+			rtt[done++] = now_us() - start;
+		} else {
+			result->rounds_lost++;
+		}
+	}
+
+	qsort(rtt, done, sizeof(*rtt), &compare_rtt);
+	for (i = 0; i < sizeof(PERCENTILES) / sizeof(*PERCENTILES); ++i) {
+		result->rtt[i] = done ? rtt[(size_t) (PERCENTILES[i] * (done - 1) + 0.5)] / 1000.0 : 0.0;
+	}
+
+out:
+	free(rtt);
+	return rc;
+}
+
+
+
+static int run_bench(const char *appname, const char *path, const unsigned int *bauds, unsigned int num_bauds, size_t bytes, unsigned int rounds) {
+	int rc;
+	pk2aux_device *device = 0;
+	pk2aux_handle handle = 0;
+	struct result result;
+	char mismatch[24];
+	unsigned int i;
+
+	/* Initialize the library. */
+	if ((rc = pk2aux_init_ex(PK2AUX_INIT_LAZY)) < 0) {
+		goto errout;
+	}
+
+	/* Find the device. */
+	device = pk2aux_find_device(path);
+	if (!device) {
+		rc = LIBUSB_ERROR_NO_DEVICE;
+		goto errout;
+	}
+
+	/* Open the device. */
+	if ((rc = pk2aux_open(device, &handle)) < 0) {
+		goto errout;
+	}
+
+	printf("%8s %10s %6s %9s %9s %9s %9s %11s %8s %9s %9s\n", "baud", "bytes/s", "line", "rtt p50", "rtt p90", "rtt p99", "rtt max", "xfers/byte", "missing",
+			"mismatch", "rtt lost");
+	for (i = 0; i < num_bauds; ++i) {
+		memset(&result, 0, sizeof(result));
+		result.baud = bauds[i];
+
+		/* Each rate gets a fresh UART. The default is enough data to keep the line busy for
+		 * a couple of seconds. */
+		if ((rc = pk2aux_start_uart(handle, bauds[i])) < 0) {
+			goto errout;
+		}
+		if ((rc = measure_throughput(handle, bauds[i], bytes ? bytes : bauds[i] / 5, &result)) < 0 || (rc = measure_latency(handle, rounds, &result)) < 0) {
+			pk2aux_stop_uart(handle);
+			goto errout;
+		}
+		if ((rc = pk2aux_stop_uart(handle)) < 0) {
+			goto errout;
+		}
+
+		if (result.mismatch < 0) {
+			strcpy(mismatch, "-");
+		} else {
+			snprintf(mismatch, sizeof(mismatch), "%lld", result.mismatch);
+		}
+		printf("%8u %10.1f %5.1f%% %7.2fms %7.2fms %7.2fms %7.2fms %11.3f %8llu %9s %9u\n", result.baud, result.bytes_per_second, result.bytes_per_second * 1000.0 / result.baud,
+				result.rtt[0], result.rtt[1], result.rtt[2], result.rtt[3], result.transactions_per_byte, result.missing, mismatch, result.rounds_lost);
+		fflush(stdout);
+	}
+	rc = LIBUSB_SUCCESS;
+
+out:
+	if (handle) {
+		if (dump_stats) {
+			pk2aux_dump_stats(handle, stderr);
+		}
+		pk2aux_close(handle);
+		handle = 0;
+	}
+	pk2aux_exit();
+	return rc == LIBUSB_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+
+errout:
+	fprintf(stderr, "%s: %s\n", appname, pk2aux_error_string(rc));
+	goto out;
+}
+
+
+
+static int parse_number(const char *string, unsigned long max, unsigned long *value) {
+	char *ptr;
+
+	if (!*string)
+		return -1;
+
+	*value = strtoul(string, &ptr, 10);
+	if (*ptr || *value > max)
+		return -1;
+
+	return 0;
+}
+
+
+
+static void usage(const char *appname) {
+	fprintf(stderr, "Usage: %s [options]\n"
+			"Options:\n"
+			" -d path, --device path      the path to the PICkit2, as printed by pk2ls\n"
+			" -b speed, --baud speed      measure this baud rate (between 92 and 57600; may be given more than once)\n"
+			" -n count, --bytes count     the number of bytes to stream at each rate (default: two seconds' worth)\n"
+			" -r count, --rounds count    the number of single-byte round trips to time at each rate (default: 100)\n"
+			" -h, --help                  display this usage message\n"
+			" -s, --stats                 print traffic statistics to stderr on exit\n"
+			"\n"
+			"Measures the UART in loopback, which needs its TX pin wired to its RX pin (or a simulated\n"
+			"PICkit2, by setting PK2AUX_SIM). For each baud rate, streams data through to find the\n"
+			"sustained throughput, then times single-byte round trips. Also reports the USB commands\n"
+			"and responses used per byte streamed, how many streamed bytes never came back, the\n"
+			"offset of the first one that came back different (if any), and how many round trips\n"
+			"timed out.\n",
+		appname);
+}
+
+
+
+int main(int argc, char **argv) {
+	int rc;
+	const char *path = 0;
+	unsigned int bauds[16], num_bauds = 0, rounds = 100;
+	unsigned long value;
+	size_t bytes = 0;
+
+	while ((rc = getopt_long(argc, argv, SHORT_OPTIONS, LONG_OPTIONS, 0)) != -1) {
+		switch (rc) {
+			case 'd':
+				path = optarg;
+				break;
+
+			case 'b':
+				if (parse_number(optarg, 57600, &value) < 0 || value < 92) {
+					fprintf(stderr, "%s: baud rate '%s' is illegal\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				if (num_bauds == sizeof(bauds) / sizeof(*bauds)) {
+					fprintf(stderr, "%s: too many baud rates\n", argv[0]);
+					return EXIT_FAILURE;
+				}
+				bauds[num_bauds++] = (unsigned int) value;
+				break;
+
+			case 'n':
+				if (parse_number(optarg, ULONG_MAX, &value) < 0 || !value) {
+					fprintf(stderr, "%s: byte count '%s' is illegal\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				bytes = value;
+				break;
+
+			case 'r':
+				if (parse_number(optarg, UINT_MAX, &value) < 0) {
+					fprintf(stderr, "%s: round count '%s' is illegal\n", argv[0], optarg);
+					return EXIT_FAILURE;
+				}
+				rounds = (unsigned int) value;
+				break;
+
+			case 'h':
+				usage(argv[0]);
+				return EXIT_SUCCESS;
+
+			case 's':
+				dump_stats = 1;
+				break;
+
+			default:
+				return EXIT_FAILURE;
+		}
+	}
+
+	if (optind != argc) {
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!num_bauds) {
+		memcpy(bauds, DEFAULT_BAUDS, sizeof(DEFAULT_BAUDS));
+		num_bauds = sizeof(DEFAULT_BAUDS) / sizeof(*DEFAULT_BAUDS);
+	}
+
+	return run_bench(argv[0], path, bauds, num_bauds, bytes, rounds);
+}
@@ -28,9 +28,11 @@
 static const struct option LONG_OPTIONS[] = {
 	{"device", required_argument, 0, 'd'},
 	{"help", no_argument, 0, 'h'},
+	{"stats", no_argument, 0, 's'},
 	{0, 0, 0, 0}
 };
-static const char SHORT_OPTIONS[] = "d:h";
+static const char SHORT_OPTIONS[] = "d:hs";
+static int dump_stats = 0;
 
 
 
@@ -41,7 +43,7 @@ static int show_version(const char *appname, const char *path) {
 	unsigned int major, minor, micro;
 
 	/* Initialize the library. */
-	if ((rc = pk2aux_init()) < 0) {
+	if ((rc = pk2aux_init_ex(PK2AUX_INIT_LAZY)) < 0) {
 		goto errout;
 	}
 
@@ -67,6 +69,9 @@ static int show_version(const char *appname, const char *path) {
 
 out:
 	if (handle) {
+		if (dump_stats) {
+			pk2aux_dump_stats(handle, stderr);
+		}
 		pk2aux_close(handle);
 		handle = 0;
 	}
@@ -85,6 +90,7 @@ static void usage(const char *appname) {
 			"Options:\n"
 			" -d path, --device path      the path to the PICkit2, as printed by pk2ls\n"
 			" -h, --help                  display this usage message\n"
+			" -s, --stats                 print traffic statistics to stderr on exit\n"
 			"\n"
 			"Displays the version of the firmware installed on the PICkit2.\n",
 		appname);
@@ -106,6 +112,10 @@ int main(int argc, char **argv) {
 				usage(argv[0]);
 				return EXIT_SUCCESS;
 
+			case 's':
+				dump_stats = 1;
+				break;
+
 			default:
 				return EXIT_FAILURE;
 		}